@@ -0,0 +1,587 @@
+// microbenchmarks for each stage (lexing, parsing, ir generation, the peephole pass
+// and dispatch) plus end-to-end runs over a generated corpus. results are printed as
+// JSON, bench/compare.py checks them against a stored run. -c instead runs the checks
+// ctest runs: the lexer against a byte-at-a-time reference, functions with empty bodies,
+// and jitted code calling into functions Lazy hasn't compiled yet.
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "parser.hpp"
+#include "backend.hpp"
+#include "glass.hpp"
+#include "lazy.hpp"
+#ifdef GLASS_JIT
+#include "jit.hpp"
+#endif
+
+namespace {
+    using namespace glass;
+
+    struct Script {
+        std::string name;
+        std::string text;
+    };
+
+    // the corpus is generated from fixed seeds, so every run sees the same programs
+    class Generator {
+    public:
+        explicit Generator(uint32_t seed) : rng(seed) {}
+
+        // n atoms joined by random operators, dividing only by non-zero literals so
+        // nothing traps. callees are spliced in as atoms
+        std::string expression(int n, const std::vector<std::string> &callees = {}){
+            std::string out = atom(callees);
+            for (int i = 1; i < n; i++){
+                char op = "+-*/"[pick(4)];
+                out += std::string(" ") + op + " ";
+                out += op == '/' ? std::to_string(pick(20) + 1) : atom(callees);
+            }
+            return out;
+        }
+
+    private:
+        std::mt19937 rng;
+
+        uint32_t pick(uint32_t n){
+            return rng() % n;
+        }
+
+        std::string atom(const std::vector<std::string> &callees){
+            std::string out = !callees.empty() && pick(3) == 0 ? callees[pick(callees.size())] + "()" : std::to_string(pick(1000));
+            return pick(8) == 0 ? "-" + out : out;
+        }
+    };
+
+    // lots of long constant expressions: front end heavy, folds down to almost nothing
+    Script arith(){
+        Generator gen(1);
+        std::string text = {};
+        for (int i = 0; i < 4000; i++)
+            text += "func a" + std::to_string(i) + "() { return " + gen.expression(40) + "; }\n";
+        text += "func main() { return a0() + a1999() - a3999(); }\n";
+        return Script { "arith", text };
+    }
+
+    // each function calls the one before it next to a pile of arithmetic, so every
+    // call has live registers around it and expressions deep enough to spill
+    Script chain(){
+        Generator gen(2);
+        std::string text = "func c0() { return " + gen.expression(12) + "; }\n";
+        for (int i = 1; i < 3000; i++){
+            std::vector<std::string> callee = { "c" + std::to_string(i - 1) };
+            text += "func c" + std::to_string(i) + "() { return " + gen.expression(6) + " * " + callee[0] + "() + "
+                + gen.expression(24) + "; }\n";
+        }
+        text += "func main() { return c2999(); }\n";
+        return Script { "chain", text };
+    }
+
+    // a binary call tree, 2^18 calls of small functions: mostly Call and Return
+    Script tree(){
+        Generator gen(3);
+        std::string text = "func t0() { return " + gen.expression(8) + "; }\n";
+        for (int i = 1; i <= 18; i++){
+            std::string prev = "t" + std::to_string(i - 1) + "()";
+            text += "func t" + std::to_string(i) + "() { return " + prev + " + " + prev + " * " + std::to_string(i) + "; }\n";
+        }
+        text += "func main() { return t18(); }\n";
+        return Script { "tree", text };
+    }
+
+    // a scripted REPL session, 10k lines of definitions and expressions using them.
+    // now and then a line doesn't compile or redefines a function, like at a real prompt
+    std::vector<std::string> session(){
+        Generator gen(4);
+        std::vector<std::string> lines = {}, leaves = {}, functions = {};
+        for (int i = 0; i < 10000; i++){
+            std::vector<std::string> pick = {};
+            if (i % 4 == 0){
+                // leaves call nothing and the rest only call leaves, so no line runs long
+                bool leaf = leaves.empty() || i % 8 == 0;
+                std::string name = i % 200 == 4 && !functions.empty() ? functions[0] : "r" + std::to_string(i);
+                for (size_t k = 0; !leaf && k < 4; k++)
+                    pick.push_back(leaves[(i * 7 + k * 13) % leaves.size()]);
+                lines.push_back("func " + name + "() { return " + gen.expression(leaf ? 10 : 6, pick) + "; }");
+                (leaf ? leaves : functions).push_back(name);
+                continue;
+            }
+            for (size_t k = 0; k < 4 && !functions.empty(); k++)
+                pick.push_back(functions[(i * 11 + k * 17) % functions.size()]);
+            lines.push_back(i % 50 == 1 ? "missing() + 1" : gen.expression(6, pick));
+        }
+        return lines;
+    }
+
+    // the lexer as it was before it scanned 16 bytes at a time. slow and obvious, so
+    // the fast one can be checked against it
+    class ReferenceLexer {
+    public:
+        ReferenceLexer(std::string_view input, size_t begin) : input(input), pos(begin) {}
+
+        Token next(){
+            while (pos < input.size() && space(input[pos]))
+                advance();
+            Token tok;
+            tok.pos = pos;
+            if (pos >= input.size())
+                return tok;
+            char n = input[pos];
+            if (word(n)){
+                while (pos < input.size() && word(input[pos]))
+                    advance();
+                tok.value = input.substr(tok.pos, pos - tok.pos);
+                tok.type = alpha(n) ? TokenType::Identifier : TokenType::IntLiteral;
+                static constexpr std::string_view reserved[] = { "func", "return", "let" };
+                for (size_t i = 0; i < std::size(reserved); i++)
+                    if (tok.value == reserved[i])
+                        tok.type = (TokenType)(i + (int)TokenType::FuncKeyword);
+                return tok;
+            }
+            advance();
+            tok.value = input.substr(tok.pos, 1);
+            const char *symbol = n ? strchr(symbols, n) : nullptr;
+            tok.type = symbol ? (TokenType)(symbol - symbols + (int)TokenType::OpenParentheses) : TokenType::Illegal;
+            return tok;
+        }
+
+        int line = 1, col = 1;
+
+    private:
+        static constexpr const char *symbols = "():;{}=+-/*";
+        std::string_view input;
+        size_t pos;
+
+        static bool space(char c){
+            return c == ' ' || (c >= '\t' && c <= '\r');
+        }
+        static bool alpha(char c){
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        }
+        static bool word(char c){
+            return alpha(c) || (c >= '0' && c <= '9') || c == '_' || c == '$';
+        }
+        void advance(){
+            if (input[pos++] == '\n'){
+                line++;
+                col = 1;
+            } else {
+                col++;
+            }
+        }
+    };
+
+    // lexes text[begin, end) both ways, false (and what differs on stderr) at the first mismatch
+    bool same_tokens(const std::string &name, const Source &source, size_t begin, size_t end){
+        Lexer lexer(source, begin, end);
+        ReferenceLexer reference(source.text().substr(0, end), begin);
+        for (size_t count = 0;; count++){
+            Token got = lexer.next(), want = reference.next();
+            SourceLocation at = lexer.get_pos();
+            bool hash = got.type != TokenType::Identifier || got.hash == hash_name(got.value);
+            if (got.type != want.type || got.pos != want.pos || got.value != want.value || !hash
+                || at.line != reference.line || at.col != reference.col){
+                std::cerr << name << ": token " << count << " at " << want.pos << " is type " << (int)got.type << " at "
+                          << got.pos << " (" << at.line << ":" << at.col << "), expected type " << (int)want.type
+                          << " (" << reference.line << ":" << reference.col << ")" << std::endl;
+                return false;
+            }
+            if (got.type == TokenType::EndOfFile)
+                return true;
+        }
+    }
+
+    // bytes meant to trip up the 16-byte scans: every whitespace class, non-ASCII,
+    // NULs and runs of spaces and word characters longer than a chunk
+    std::string soup(uint32_t seed, size_t size){
+        std::mt19937 rng(seed);
+        const std::string pieces[] = { " ", "\t", "\n", "\v", "\f", "\r", "\r\n", "func", "return", "let", "x_$9",
+                                       "0123", "():;{}=+-/*", "#", std::string(1, '\0'), "\x80", "\xff", "\xc3\xa9" };
+        std::string out = {};
+        while (out.size() < size){
+            uint32_t roll = rng() % 24;
+            if (roll < std::size(pieces))
+                out += pieces[roll];
+            else if (roll < 21)
+                out += std::string(rng() % 40, " \t\n\v\f\r"[rng() % 6]);
+            else if (roll < 23)
+                out += std::string(rng() % 40 + 1, "aZ_$7"[rng() % 5]);
+            else
+                out += (char)(rng() % 256);
+        }
+        return out;
+    }
+
+    // the corpus and some soup, whole and in windows that end at every alignment
+    bool check_lexer(const std::vector<Script> &corpus){
+        std::vector<std::pair<std::string, Source>> inputs = {};
+        for (const Script &program : corpus)
+            inputs.push_back({program.name, Source(program.text)});
+        for (uint32_t seed = 1; seed <= 4; seed++)
+            inputs.push_back({"soup" + std::to_string(seed), Source(soup(seed, 100000))});
+
+        bool ok = true;
+        for (const auto &[name, source] : inputs){
+            size_t size = source.text().size();
+            ok &= same_tokens(name, source, 0, size);
+            std::mt19937 rng(size);
+            for (int i = 0; i < 200; i++){
+                size_t begin = rng() % size, end = std::min(size, begin + rng() % 64);
+                ok &= same_tokens(name + "[" + std::to_string(begin) + "," + std::to_string(end) + ")", source, begin, end);
+            }
+        }
+        std::cerr << (ok ? "lexer matches the reference" : "lexer differs from the reference") << std::endl;
+        return ok;
+    }
+
+    // an empty body used to leave nothing between its entry and the next function (or
+    // the end of the code). fuel turns running off into something else into a failure
+    bool check_empty_bodies(){
+        bool ok = true;
+        auto expect = [&](const std::string &what, const Result<std::optional<uintptr_t>> &result, std::optional<uintptr_t> want){
+            if (!result)
+                std::cerr << what << ": " << result.error().message << std::endl;
+            else if (*result != want)
+                std::cerr << what << ": expected " << (want ? std::to_string(*want) : "nothing") << std::endl;
+            else
+                return;
+            ok = false;
+        };
+
+        Session session;
+        session.vm().fuel = 1000;
+        expect("repl func f(){}", session.feed("func f(){}"), std::nullopt);
+        expect("repl f()", session.feed("f()"), 0);
+        expect("repl func g(){} return g();", session.feed("func g(){} return g();"), 0);
+        expect("repl f() + 2", session.feed("f() + 2"), 2);
+
+        // the body compiled last sits at the very end, so its entry has to be an instruction
+        Lazy lazy{Source("func main(){ return f() + 3; }\nfunc f(){}\n")};
+        if (lazy.scan()){
+            VM vm;
+            vm.fuel = 1000;
+            vm.program = lazy.program();
+            vm.lazy = &lazy;
+            int entry = lazy.compile(vm, lazy.builder().names.find("f"));
+            if (entry < 0 || (size_t)entry >= vm.program->size){
+                std::cerr << "lazy func f(){}: entry " << entry << " is past the code" << std::endl;
+                ok = false;
+            }
+            vm.pc = lazy.builder().entry("main");
+            if (!vm.run() || vm.registers[0] != 3){
+                std::cerr << "lazy f() + 3: " << (vm.trap != Trap::None ? trap_message(vm.trap) : "expected 3") << std::endl;
+                ok = false;
+            }
+        } else {
+            std::cerr << "lazy func f(){}: " << lazy.failure->message << std::endl;
+            ok = false;
+        }
+
+        std::cerr << (ok ? "empty bodies return" : "empty bodies don't return") << std::endl;
+        return ok;
+    }
+
+#ifdef GLASS_JIT
+    // h is jitted before g is compiled, so calling g from h grows the program (and moves
+    // it, it's big enough) under the interpreter running main. ctest has malloc unmap big
+    // blocks when they're freed, so anything still reading the old code faults
+    bool check_lazy_jit(){
+        std::string calls = {};
+        for (int i = 0; i < 3000; i++)
+            calls += i ? " + z()" : "z()";
+        Lazy lazy{Source("func main(){ return h() + 1; }\nfunc h(){ return g() + 1; }\nfunc z(){ return 1; }\n"
+                         "func big(){ return " + calls + "; }\nfunc g(){ return " + calls + " + " + calls + "; }\n")};
+        bool ok = lazy.scan();
+        VM vm;
+        JIT jit(1);
+        if (ok){
+            vm.program = lazy.program();
+            vm.lazy = &lazy;
+            for (const char *name : {"big", "main", "h"})
+                lazy.compile(vm, lazy.builder().names.find(name));
+            vm.jit = &jit;
+            vm.pc = lazy.builder().entry("main");
+            ok = vm.run() && vm.registers[0] == 6002;
+        }
+        std::cerr << (ok ? "lazy code grows safely under jitted code" : "lazy code under jitted code went wrong") << std::endl;
+        return ok;
+    }
+#endif
+
+    struct Benchmark {
+        std::string name;
+        double value;
+        const char *unit;
+        bool higher_is_better;
+    };
+
+    double min_time = 0.2; // seconds each batch runs for
+    int rounds = 5;        // batches, the best one counts
+
+    // seconds per call of body, the best of several batches
+    double measure(const std::function<void()> &body){
+        using clock = std::chrono::steady_clock;
+        double best = 1e300;
+        for (int round = 0; round < rounds; round++){
+            size_t calls = 0;
+            auto start = clock::now();
+            double elapsed;
+            do {
+                body();
+                calls++;
+                elapsed = std::chrono::duration<double>(clock::now() - start).count();
+            } while (elapsed < min_time);
+            best = std::min(best, elapsed / calls);
+        }
+        return best;
+    }
+
+    IRBuilder build(const Ast &ast, bool optimize){
+        IRBuilder builder = {};
+        builder.feed(ast);
+        builder.finalize();
+        if (optimize)
+            builder.optimize();
+        return builder;
+    }
+
+    Ast parse(const Source &source){
+        Parser parser{Lexer(source)};
+        while (parser.next_node()) {}
+        return std::move(parser.ast);
+    }
+
+    // instructions a call to entry dispatches. there's no branching, so a function is
+    // everything up to its first Return (or TailCall) and its calls add their callees' counts
+    uint64_t executed(const std::vector<Instruction> &program, uint32_t entry, std::vector<uint64_t> &memo){
+        if (memo[entry])
+            return memo[entry];
+        uint64_t count = 0;
+        for (uint32_t pc = entry; pc < program.size(); pc++){
+            count++;
+            InstructionType type = program[pc].type;
+            if (type == InstructionType::Call || type == InstructionType::TailCall)
+                count += executed(program, program[pc].imm, memo);
+            if (type == InstructionType::Return || type == InstructionType::LoadImmReturn || type == InstructionType::TailCall
+                || type == InstructionType::Halt)
+                break;
+        }
+        return memo[entry] = count;
+    }
+
+    volatile uintptr_t sink = 0; // keeps results alive so nothing gets optimized away
+
+    void bench_program(const Script &program, const std::string &filter, std::vector<Benchmark> &results){
+        auto wanted = [&](const std::string &name){
+            return filter.empty() || name.find(filter) != std::string::npos;
+        };
+        auto add = [&](const std::string &name, double value, const char *unit, bool higher_is_better){
+            results.push_back(Benchmark { name, value, unit, higher_is_better });
+            std::cerr << name << ": " << value << " " << unit << std::endl;
+        };
+
+        Source source(program.text);
+        const double mb = program.text.size() / 1e6;
+
+        if (wanted("lex/" + program.name)){
+            double t = measure([&]{
+                Lexer lexer(source);
+                size_t tokens = 0;
+                while (lexer.next().type != TokenType::EndOfFile)
+                    tokens++;
+                sink += tokens;
+            });
+            add("lex/" + program.name, mb / t, "MB/s", true);
+        }
+
+        Ast ast = parse(source);
+        if (wanted("parse/" + program.name)){
+            double t = measure([&]{
+                sink += parse(source).nodes.size();
+            });
+            add("parse/" + program.name, ast.nodes.size() / t / 1e6, "Mnodes/s", true);
+        }
+
+        IRBuilder plain = build(ast, false);
+        if (wanted("irgen/" + program.name)){
+            double t = measure([&]{
+                sink += build(ast, false).ir.size();
+            });
+            add("irgen/" + program.name, ast.nodes.size() / t / 1e6, "Mnodes/s", true);
+        }
+
+        if (wanted("optimize/" + program.name)){
+            // copying the builder is part of it, optimize() works in place
+            double t = measure([&]{
+                IRBuilder builder = plain;
+                builder.optimize();
+                sink += builder.ir.size();
+            });
+            add("optimize/" + program.name, plain.ir.size() / t / 1e6, "Minstructions/s", true);
+        }
+
+        IRBuilder optimized = build(ast, true);
+        if (wanted("shake/" + program.name)){
+            double t = measure([&]{
+                IRBuilder builder = optimized;
+                builder.shake({"main"});
+                sink += builder.ir.size();
+            });
+            add("shake/" + program.name, optimized.ir.size() / t / 1e6, "Minstructions/s", true);
+        }
+        uint32_t entry = optimized.entry("main");
+        std::vector<uint64_t> memo(optimized.ir.size() + 1, 0);
+        uint64_t count = executed(optimized.ir, entry, memo);
+        // a few instructions would mostly measure call()
+        if (count >= 10000 && wanted("dispatch/" + program.name)){
+            VM vm = {};
+            vm.program = Program::make(optimized.ir, optimized.constants);
+            double t = measure([&]{
+                vm.call(entry);
+                sink += vm.registers[0];
+            });
+            add("dispatch/" + program.name, t * 1e9 / count, "ns/op", false);
+        }
+        // the same with fuel and a deadline, which only get checked at calls and returns
+        if (count >= 10000 && wanted("metered/" + program.name)){
+            VM vm = {};
+            vm.program = Program::make(optimized.ir, optimized.constants);
+            double t = measure([&]{
+                vm.fuel = count * 2;
+                vm.deadline = VM::clock::now() + std::chrono::seconds(10);
+                vm.call(entry);
+                sink += vm.registers[0];
+            });
+            add("metered/" + program.name, t * 1e9 / count, "ns/op", false);
+        }
+
+        if (wanted("lazy/" + program.name)){
+            // e2e again, compiling only the functions main gets to
+            VMPool pool;
+            double t = measure([&]{
+                Lazy lazy{Source(program.text)};
+                lazy.scan();
+                VM vm = pool.acquire();
+                vm.program = lazy.program();
+                vm.lazy = &lazy;
+                vm.pc = lazy.builder().entry("main");
+                vm.run();
+                sink += vm.registers[0];
+            });
+            add("lazy/" + program.name, t * 1e3, "ms", false);
+        }
+
+        if (wanted("e2e/" + program.name)){
+            VMPool pool;
+            double t = measure([&]{
+                IRBuilder builder = build(parse(Source(program.text)), true);
+                VM vm = pool.acquire();
+                vm.program = Program::make(std::move(builder.ir), std::move(builder.constants));
+                vm.pc = builder.entry("main");
+                vm.run();
+                sink += vm.registers[0];
+            });
+            add("e2e/" + program.name, t * 1e3, "ms", false);
+        }
+    }
+
+    void bench_session(const std::vector<std::string> &lines, const std::string &filter, std::vector<Benchmark> &results){
+        if (!filter.empty() && std::string("repl/session").find(filter) == std::string::npos)
+            return;
+        double t = measure([&]{
+            Session repl;
+            for (const std::string &line : lines){
+                auto result = repl.feed(line);
+                sink += result && *result ? **result : 1;
+            }
+        });
+        double value = t * 1e6 / lines.size();
+        results.push_back(Benchmark { "repl/session", value, "us/line", false });
+        std::cerr << "repl/session: " << value << " us/line" << std::endl;
+    }
+
+    void write_json(std::ostream &out, const std::vector<Benchmark> &results){
+        out << "{\"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++){
+            const Benchmark &result = results[i];
+            out << "  {\"name\": \"" << result.name << "\", \"value\": " << result.value << ", \"unit\": \"" << result.unit
+                << "\", \"higher_is_better\": " << (result.higher_is_better ? "true" : "false") << "}"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "]}" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]){
+    const char *output = nullptr;
+    const char *corpus_dir = nullptr;
+    bool check = false;
+    std::string filter = {};
+    for (int argi = 1; argi < argc; argi++){
+        if (!strcmp(argv[argi], "-o") && argi + 1 < argc)
+            output = argv[++argi];
+        else if (!strcmp(argv[argi], "-f") && argi + 1 < argc)
+            filter = argv[++argi];
+        else if (!strcmp(argv[argi], "-w") && argi + 1 < argc)
+            corpus_dir = argv[++argi];
+        else if (!strcmp(argv[argi], "-c"))
+            check = true;
+        else if (!strcmp(argv[argi], "-r") && argi + 1 < argc)
+            rounds = std::max(1, atoi(argv[++argi]));
+        else if (!strcmp(argv[argi], "-q")){
+            min_time = 0.02;
+            rounds = 2;
+        } else {
+            std::cerr << "usage: glass_bench [-q] [-r ROUNDS] [-f FILTER] [-o FILE] [-w DIR] [-c]" << std::endl;
+            std::cerr << "\t-q\tquick run, shorter and noisier" << std::endl;
+            std::cerr << "\t-r ROUNDS\tbatches per benchmark, the best counts (5)" << std::endl;
+            std::cerr << "\t-f FILTER\tonly runs benchmarks whose name contains FILTER" << std::endl;
+            std::cerr << "\t-o FILE\twrites the JSON results to FILE instead of stdout" << std::endl;
+            std::cerr << "\t-w DIR\twrites the corpus to DIR as .gls files and exits" << std::endl;
+            std::cerr << "\t-c\truns the checks ctest runs and exits" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<Script> corpus = { arith(), chain(), tree() };
+    if (check){
+        bool ok = check_lexer(corpus) & check_empty_bodies();
+#ifdef GLASS_JIT
+        ok &= check_lazy_jit();
+#endif
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (corpus_dir){
+        for (const Script &program : corpus){
+            std::string path = std::string(corpus_dir) + "/" + program.name + ".gls";
+            std::ofstream out(path);
+            if (!(out << program.text)){
+                std::cerr << "glass_bench: failed to write " << path << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<Benchmark> results = {};
+    for (const Script &program : corpus)
+        bench_program(program, filter, results);
+    bench_session(session(), filter, results);
+
+    if (output){
+        std::ofstream out(output);
+        write_json(out, results);
+        if (!out){
+            std::cerr << "glass_bench: failed to write " << output << std::endl;
+            return EXIT_FAILURE;
+        }
+    } else {
+        write_json(std::cout, results);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# compares two glass_bench runs and flags everything that got worse by more than
+# the threshold. exits with 1 if anything did, so it can gate a build.
+#   glass_bench -o baseline.json   (on the old tree, Release build)
+#   glass_bench -o new.json        (on the new one, same machine)
+#   bench/compare.py baseline.json new.json [-t PERCENT]
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {b["name"]: b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare glass_bench results against a baseline")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("-t", "--threshold", type=float, default=5.0,
+                        help="percent a benchmark may get worse before it counts as a regression (default 5)")
+    args = parser.parse_args()
+
+    baseline, current = load(args.baseline), load(args.current)
+    regressions = 0
+    print(f"{'benchmark':<24}{'baseline':>14}{'current':>14}{'change':>10}")
+    for name, now in current.items():
+        old = baseline.get(name)
+        if old is None:
+            print(f"{name:<24}{'':>14}{now['value']:>14.4g}{'new':>10}")
+            continue
+        if old["value"] == 0:
+            continue
+        change = (now["value"] - old["value"]) / old["value"] * 100
+        # positive is better, whichever way the unit goes
+        better = change if now["higher_is_better"] else -change
+        flag = ""
+        if better < -args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif better > args.threshold:
+            flag = "  faster"
+        print(f"{name:<24}{old['value']:>14.4g}{now['value']:>14.4g}{change:>+9.1f}%  {now['unit']}{flag}")
+    for name in baseline.keys() - current.keys():
+        print(f"{name:<24}{'':>14}{'':>14}{'gone':>10}")
+
+    if regressions:
+        print(f"{regressions} regression(s) beyond {args.threshold:g}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,238 @@
+#include "aot.hpp"
+#include "backend.hpp"
+#include "runtime.hpp"
+#include "x86.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stddef.h>
+#include <elf.h>
+
+namespace glass {
+    namespace {
+        struct Function {
+            std::string name;
+            int entry;
+            size_t offset = 0, size = 0;
+        };
+
+        struct Fixup {
+            size_t at;
+            int target;
+        };
+
+        template <typename T>
+        void append(std::vector<unsigned char> &out, const T &value){
+            const unsigned char *p = (const unsigned char *)&value;
+            out.insert(out.end(), p, p + sizeof(T));
+        }
+
+        void align(std::vector<unsigned char> &out, size_t to){
+            out.resize((out.size() + to - 1) & ~(to - 1), 0);
+        }
+
+        uint32_t add_string(std::vector<unsigned char> &table, const std::string &str){
+            uint32_t at = table.size();
+            table.insert(table.end(), str.begin(), str.end());
+            table.push_back(0);
+            return at;
+        }
+    }
+
+    std::optional<std::vector<unsigned char>> compile_object(const IRBuilder &builder){
+        if (builder.entry("main") < 0)
+            return {};
+
+        std::vector<Function> functions = {};
+        for (uint32_t name = 0; name < builder.symbols.size(); name++)
+            if (builder.symbols[name] >= 0)
+                functions.push_back(Function { .name = builder.names[name], .entry = builder.symbols[name] });
+        std::sort(functions.begin(), functions.end(), [](const Function &a, const Function &b){
+            return a.entry < b.entry;
+        });
+
+        // calls lower to plain native calls. only functions that spill need a
+        // frame, and they set base themselves since there's no VM Call to do it
+        X86Assembler e(X86Assembler::Layout {
+            .regs = offsetof(glass_state, registers),
+            .stack = offsetof(glass_state, stack),
+            .sp = offsetof(glass_state, sp),
+            .base = offsetof(glass_state, base),
+        });
+        std::vector<Fixup> fixups = {};
+        for (Function &fn : functions){
+            fn.offset = e.code.size();
+            e.prologue();
+            // no branches yet, so a function ends at its first Return (or LoadImmReturn, TailCall)
+            bool framed = false;
+            for (size_t pc = fn.entry; pc < builder.ir.size(); pc++){
+                InstructionType type = builder.ir[pc].type;
+                if (type == InstructionType::Return || type == InstructionType::LoadImmReturn
+                    || type == InstructionType::TailCall)
+                    break;
+                framed |= type == InstructionType::Push || type == InstructionType::AddrStack
+                    || type == InstructionType::LoadStack || type == InstructionType::StrStack;
+            }
+            if (framed)
+                e.enter_frame();
+            for (size_t pc = fn.entry;; pc++){
+                if (pc >= builder.ir.size())
+                    return {};
+                const Instruction &ins = builder.ir[pc];
+                if (ins.type == InstructionType::LoadImmReturn)
+                    e.lower(Instruction { .type = InstructionType::LoadImm, .dst = ins.dst, .imm = ins.imm }, builder.constants.data());
+                if (ins.type == InstructionType::Return || ins.type == InstructionType::LoadImmReturn){
+                    if (framed)
+                        e.leave_frame();
+                    e.epilogue();
+                    break;
+                }
+                if (ins.type == InstructionType::TailCall){
+                    // a real tail call, the callee returns straight to our caller
+                    if (framed)
+                        e.leave_frame();
+                    fixups.push_back(Fixup { .at = e.jump_rel(), .target = (int)ins.imm });
+                    break;
+                }
+                if (ins.type == InstructionType::Call)
+                    fixups.push_back(Fixup { .at = e.call_rel(), .target = (int)ins.imm });
+                else if (!e.lower(ins, builder.constants.data()))
+                    return {};
+            }
+            fn.size = e.code.size() - fn.offset;
+        }
+        for (const Fixup &fixup : fixups){
+            auto it = std::find_if(functions.cbegin(), functions.cend(), [&](const Function &fn){
+                return fn.entry == fixup.target;
+            });
+            if (it == functions.cend())
+                return {};
+            e.patch_rel(fixup.at, it->offset);
+        }
+
+        // symbols: null, one local per glass function, then the global entry point
+        std::vector<unsigned char> strtab = {0};
+        std::vector<unsigned char> symtab = {};
+        append(symtab, Elf64_Sym {});
+        for (const Function &fn : functions){
+            append(symtab, Elf64_Sym {
+                .st_name = add_string(strtab, "glass." + fn.name),
+                .st_info = ELF64_ST_INFO(STB_LOCAL, STT_FUNC),
+                .st_other = 0,
+                .st_shndx = 1,
+                .st_value = fn.offset,
+                .st_size = fn.size,
+            });
+        }
+        const Function &main_fn = *std::find_if(functions.cbegin(), functions.cend(), [](const Function &fn){
+            return fn.name == "main";
+        });
+        append(symtab, Elf64_Sym {
+            .st_name = add_string(strtab, "glass_main"),
+            .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC),
+            .st_other = 0,
+            .st_shndx = 1,
+            .st_value = main_fn.offset,
+            .st_size = main_fn.size,
+        });
+
+        std::vector<unsigned char> shstrtab = {0};
+        uint32_t text_name = add_string(shstrtab, ".text");
+        uint32_t symtab_name = add_string(shstrtab, ".symtab");
+        uint32_t strtab_name = add_string(shstrtab, ".strtab");
+        uint32_t shstrtab_name = add_string(shstrtab, ".shstrtab");
+        uint32_t note_name = add_string(shstrtab, ".note.GNU-stack");
+
+        std::vector<unsigned char> out(sizeof(Elf64_Ehdr), 0);
+        align(out, 16);
+        size_t text_off = out.size();
+        out.insert(out.end(), e.code.begin(), e.code.end());
+        align(out, 8);
+        size_t symtab_off = out.size();
+        out.insert(out.end(), symtab.begin(), symtab.end());
+        size_t strtab_off = out.size();
+        out.insert(out.end(), strtab.begin(), strtab.end());
+        size_t shstrtab_off = out.size();
+        out.insert(out.end(), shstrtab.begin(), shstrtab.end());
+        align(out, 8);
+        size_t shoff = out.size();
+
+        append(out, Elf64_Shdr {});
+        append(out, Elf64_Shdr {
+            .sh_name = text_name,
+            .sh_type = SHT_PROGBITS,
+            .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+            .sh_addr = 0,
+            .sh_offset = text_off,
+            .sh_size = e.code.size(),
+            .sh_link = 0,
+            .sh_info = 0,
+            .sh_addralign = 16,
+            .sh_entsize = 0,
+        });
+        append(out, Elf64_Shdr {
+            .sh_name = symtab_name,
+            .sh_type = SHT_SYMTAB,
+            .sh_flags = 0,
+            .sh_addr = 0,
+            .sh_offset = symtab_off,
+            .sh_size = symtab.size(),
+            .sh_link = 3,
+            .sh_info = (uint32_t)functions.size() + 1, // first global
+            .sh_addralign = 8,
+            .sh_entsize = sizeof(Elf64_Sym),
+        });
+        append(out, Elf64_Shdr {
+            .sh_name = strtab_name,
+            .sh_type = SHT_STRTAB,
+            .sh_flags = 0,
+            .sh_addr = 0,
+            .sh_offset = strtab_off,
+            .sh_size = strtab.size(),
+            .sh_link = 0,
+            .sh_info = 0,
+            .sh_addralign = 1,
+            .sh_entsize = 0,
+        });
+        append(out, Elf64_Shdr {
+            .sh_name = shstrtab_name,
+            .sh_type = SHT_STRTAB,
+            .sh_flags = 0,
+            .sh_addr = 0,
+            .sh_offset = shstrtab_off,
+            .sh_size = shstrtab.size(),
+            .sh_link = 0,
+            .sh_info = 0,
+            .sh_addralign = 1,
+            .sh_entsize = 0,
+        });
+        append(out, Elf64_Shdr {
+            .sh_name = note_name,
+            .sh_type = SHT_PROGBITS,
+            .sh_flags = 0,
+            .sh_addr = 0,
+            .sh_offset = shoff,
+            .sh_size = 0,
+            .sh_link = 0,
+            .sh_info = 0,
+            .sh_addralign = 1,
+            .sh_entsize = 0,
+        });
+
+        Elf64_Ehdr header = {};
+        memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS64;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_REL;
+        header.e_machine = EM_X86_64;
+        header.e_version = EV_CURRENT;
+        header.e_shoff = shoff;
+        header.e_ehsize = sizeof(Elf64_Ehdr);
+        header.e_shentsize = sizeof(Elf64_Shdr);
+        header.e_shnum = 6;
+        header.e_shstrndx = 4;
+        memcpy(out.data(), &header, sizeof(header));
+        return out;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef __AOT_HPP__
+#define __AOT_HPP__
+#include <optional>
+#include <vector>
+
+namespace glass {
+    class IRBuilder;
+
+    // lowers a finalized program to x86-64 and packs it into a relocatable ELF
+    // object exporting glass_main, to be linked against the glassrt runtime.
+    // empty if the program uses something that can't be lowered.
+    std::optional<std::vector<unsigned char>> compile_object(const IRBuilder &builder);
+}
+
+#endif//__AOT_HPP__
@@ -1,81 +1,292 @@
 #include "backend.hpp"
 #include "parser.hpp"
-
-#define get(i, x) std::get<Instruction::x>(i.data)
+#include <atomic>
+#include <charconv>
+#ifdef GLASS_JIT
+#include "jit.hpp"
+#endif
+#ifdef GLASS_PROFILE
+#include "profile.hpp"
+#endif
+#include "lazy.hpp"
 
 namespace glass {
-    void VM::step(){
+#if defined(GLASS_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define GLASS_COMPUTED_GOTO
+#endif
+
+    void VM::execute(){
+        const Instruction *code = program->code;
+        const uintptr_t *constants = program->constants;
+        const Instruction *ip = code + pc;
+        const Instruction *ins;
+
+        // fuel is charged for each stretch of straight code when it ends at a Call,
+        // TailCall or Return: ip - mark is exactly what ran since. left is what may
+        // still run before meter() has to look at fuel and the clock again
+#ifdef GLASS_JIT
+        const bool native = jit && !metered();
+#endif
+#ifdef GLASS_PROFILE
+        const bool resumed = resuming;
+#endif
+        resuming = false;
+        int64_t slice = meter(0);
+        int64_t left = slice;
+        const Instruction *mark = ip;
+        if (!slice)
+            return;
+
+        // every run starts at a function entry and ends with its Return (or Halt), or
+        // carries on where the last one stopped, which doesn't count as a call
+#ifdef GLASS_PROFILE
+        Profile *prof = profile;
+        if (prof)
+            resumed ? prof->resume(pc) : prof->enter(pc);
+#define vm_fetch() (ins = ip++, prof ? prof->step(ins - code, ins->type) : (void)0, ins)
+#define vm_profile(hook) if (prof) prof->hook
+#else
+#define vm_fetch() (ins = ip++)
+#define vm_profile(hook)
+#endif
+
+        // the sampler walks frames from a signal handler on this thread, so the frame has
+        // to be in memory before base points at it, and base before pc. a compiler-only
+        // barrier, nothing is emitted for it
+#define vm_publish() std::atomic_signal_fence(std::memory_order_release)
+
+        // native code calls back into the VM, where a Lazy can grow the program and
+        // move it. so after native code, everything pointing into it is looked up again
+#define vm_rebase() { \
+            const Instruction *moved = program->code; \
+            ip = moved + (ip - code); \
+            ins = moved + (ins - code); \
+            code = moved; \
+            constants = program->constants; \
+        }
+
+        // stops before ins, which runs again on resume()
+#define vm_meter() \
+        if ((left -= ip - mark) < 0 && !(left = slice = meter(slice - left))){ \
+            pc = ins - code; \
+            vm_profile(leave()); \
+            return; \
+        }
+
+#ifdef GLASS_COMPUTED_GOTO
+        // must be kept in the same order as InstructionType
+        static void *const dispatch_table[] = {
+            &&op_Push, &&op_Pop, &&op_AddrStack,
+            &&op_LoadByte, &&op_LoadHalf, &&op_LoadWord, &&op_LoadLong, &&op_LoadPtr,
+            &&op_LoadImm, &&op_LoadConst, &&op_Move,
+            &&op_StrByte, &&op_StrHalf, &&op_StrWord, &&op_StrLong, &&op_StrPtr,
+            &&op_Add, &&op_Sub, &&op_Mul, &&op_Div,
+            &&op_Shl, &&op_Shr,
+            &&op_AddImm, &&op_SubImm, &&op_MulImm, &&op_DivImm,
+            &&op_ShlImm, &&op_ShrImm,
+            &&op_LoadStack, &&op_StrStack,
+            &&op_Halt,
+            &&op_Call, &&op_TailCall, &&op_Return, &&op_LoadImmReturn, &&op_Compile,
+            &&op_Symbol,
+        };
+        static_assert(sizeof(dispatch_table) / sizeof(*dispatch_table) == (size_t)InstructionType::Symbol + 1,
+                      "dispatch table out of sync with InstructionType");
+
+#define vm_case(name) op_##name:
+#define vm_next() goto *dispatch_table[(size_t)vm_fetch()->type]
+        vm_next();
+#else
 #define vm_case(name) case InstructionType::name:
-        const Instruction &ins = program[pc++];
-        switch (ins.type){
+#define vm_next() continue
+        for (;;) switch (vm_fetch()->type) {
+#endif
 
         vm_case(Symbol) {
-            break;
+            vm_next();
         }
 
         vm_case(Halt){
-            should_exit = true;
-            break;
+            charge(slice - left + (ip - mark));
+            pc = ip - code;
+            vm_profile(leave());
+            return;
         }
 
         vm_case(Push){
-            sp -= get(ins, I).value;
-            break;
+            sp -= ins->imm;
+            vm_next();
         }
 
         vm_case(Pop){
-            sp += get(ins, I).value;
-            break;
+            sp += ins->imm;
+            vm_next();
         }
 
         vm_case(AddrStack){
-            registers[get(ins, I).dst] = (uintptr_t)&stack[base - get(ins, I).value];
-            break;
+            registers[ins->dst] = (uintptr_t)&stack[base - ins->imm];
+            vm_next();
         }
 
         vm_case(Call){
+            vm_meter();
             push_stack<int>(base);
-            push_stack<int>(pc);
-            pc = get(ins, B).new_pc;
-            break;
+            push_stack<int>(ip - code);
+            vm_publish();
+            base = sp;
+            pc = ins->imm;
+            vm_publish();
+#ifdef GLASS_JIT
+            if (native && native_depth < max_native_depth){
+                if (JIT::Function fn = jit->hot(*this, ins->imm)){
+                    int next = run_native(fn);
+                    vm_rebase();
+                    if (next >= 0){
+                        // it tail called something interpreted, which carries on in the frame
+                        vm_profile(enter(next));
+                        ip = code + next;
+                        mark = ip;
+                        vm_next();
+                    }
+                    sp = base;
+                    pop_stack<int>();
+                    base = pop_stack<int>();
+                    pc = ip - code;
+                    vm_publish();
+                    mark = ip;
+                    vm_next();
+                }
+            }
+#endif
+            vm_profile(enter(ins->imm));
+            ip = code + ins->imm;
+            mark = ip;
+            vm_next();
+        }
+
+        vm_case(TailCall){
+            // the callee reuses this frame, so it returns straight to our caller and
+            // recursion through return f() runs in constant stack
+            vm_meter();
+            sp = base;
+#ifdef GLASS_JIT
+            if (native && native_depth < max_native_depth){
+                if (JIT::Function fn = jit->hot(*this, ins->imm)){
+                    pc = ins->imm;
+                    vm_publish();
+                    int next = run_native(fn);
+                    vm_rebase();
+                    if (next >= 0){
+                        vm_profile(leave());
+                        vm_profile(enter(next));
+                        ip = code + next;
+                        mark = ip;
+                        vm_next();
+                    }
+                    mark = ip;
+                    goto vm_return;
+                }
+            }
+#endif
+            vm_profile(leave());
+            vm_profile(enter(ins->imm));
+            pc = ins->imm;
+            vm_publish();
+            ip = code + ins->imm;
+            mark = ip;
+            vm_next();
+        }
+
+        vm_case(LoadImmReturn){
+            registers[ins->dst] = ins->imm;
+            goto vm_return;
         }
 
         vm_case(Return){
-            pc = pop_stack<int>();
-            if (pc == 0) {
-                should_exit = true;
-                break;
+        vm_return:
+            vm_meter();
+            vm_profile(leave());
+            sp = base;
+            // returning from the entry point leaves the sentinel in place so the VM can be run again
+            if (get_stack<int>(0) == 0) {
+                charge(slice - left);
+                pc = ip - code;
+                return;
             }
+            ip = code + pop_stack<int>();
             base = pop_stack<int>();
-            break;
+            pc = ip - code;
+            vm_publish();
+            mark = ip;
+            vm_next();
+        }
+
+        vm_case(Compile){
+            // the Call or TailCall already set up the frame, so once the function
+            // exists it just carries on there. the program has grown, everything is
+            // reloaded
+            int entry = lazy ? lazy->compile(*this, ins->imm) : -1;
+            if (entry < 0)
+                unwind(Trap::CompileError);
+            code = program->code;
+            constants = program->constants;
+            ip = code + entry;
+            mark = ip;
+            pc = entry;
+            vm_next();
         }
 
         vm_case(LoadImm){
-            registers[get(ins, I).dst] = get(ins, I).value;
-            break;
+            registers[ins->dst] = ins->imm;
+            vm_next();
+        }
+
+        vm_case(LoadConst){
+            registers[ins->dst] = constants[ins->imm];
+            vm_next();
+        }
+
+        vm_case(Move){
+            registers[ins->dst] = registers[ins->src];
+            vm_next();
+        }
+
+        vm_case(LoadStack){
+            registers[ins->dst] = *(uint64_t*)&stack[base - ins->imm];
+            vm_next();
+        }
+
+        vm_case(StrStack){
+            *(uint64_t*)&stack[base - ins->imm] = registers[ins->dst];
+            vm_next();
         }
 
 #define load_case(name, type) \
         vm_case(name){ \
-            registers[get(ins, M).dst] = *(type*)(registers[get(ins, M).base] + get(ins, M).index); \
-            break; \
+            registers[ins->dst] = *(type*)(registers[ins->src] + (int32_t)ins->imm); \
+            vm_next(); \
         }
 
 #define str_case(name, type) \
         vm_case(name){ \
-            *(type*)(registers[get(ins, M).base] + get(ins, M).index) = registers[get(ins, M).dst]; \
-            break; \
+            *(type*)(registers[ins->src] + (int32_t)ins->imm) = registers[ins->dst]; \
+            vm_next(); \
         }
 
 #define op_case(name, op) \
         vm_case(name){ \
-            registers[get(ins, R).dst] = registers[get(ins, R).dst] op registers[get(ins, R).src]; \
-            break; \
+            registers[ins->dst] = registers[ins->dst] op registers[ins->src]; \
+            vm_next(); \
+        } \
+        vm_case(name##Imm){ \
+            registers[ins->dst] = registers[ins->dst] op (uintptr_t)ins->imm; \
+            vm_next(); \
         }
 
         op_case(Add, +)
         op_case(Sub, -)
         op_case(Div, /)
+        op_case(Shl, <<)
+        op_case(Shr, >>)
         op_case(Mul, *)
 
         load_case(LoadByte, char)
@@ -88,60 +299,428 @@ namespace glass {
          str_case(StrWord,  uint32_t)
          str_case(StrLong,  uint64_t)
          str_case(StrPtr,   uintptr_t)
-    
+
 #undef load_case
 #undef str_case
 #undef op_case
-    }
+#ifndef GLASS_COMPUTED_GOTO
+        }
+#endif
+#undef vm_next
 #undef vm_case
+#undef vm_fetch
+#undef vm_profile
+#undef vm_rebase
+#undef vm_meter
+#undef vm_publish
+    }
+
+    const char *instruction_name(InstructionType type){
+        // same order as InstructionType
+        static const char *const names[] = {
+            "Push", "Pop", "AddrStack",
+            "LoadByte", "LoadHalf", "LoadWord", "LoadLong", "LoadPtr",
+            "LoadImm", "LoadConst", "Move",
+            "StrByte", "StrHalf", "StrWord", "StrLong", "StrPtr",
+            "Add", "Sub", "Mul", "Div",
+            "Shl", "Shr",
+            "AddImm", "SubImm", "MulImm", "DivImm",
+            "ShlImm", "ShrImm",
+            "LoadStack", "StrStack",
+            "Halt",
+            "Call", "TailCall", "Return", "LoadImmReturn", "Compile",
+            "Symbol",
+        };
+        static_assert(sizeof(names) / sizeof(*names) == (size_t)InstructionType::Symbol + 1,
+                      "instruction names out of sync with InstructionType");
+        return (size_t)type < sizeof(names) / sizeof(*names) ? names[(size_t)type] : "?";
+    }
+
+    const char *trap_message(Trap trap){
+        switch (trap){
+        case Trap::None: return "no trap";
+        case Trap::StackOverflow: return "stack overflow";
+        case Trap::OutOfFuel: return "out of fuel";
+        case Trap::Deadline: return "deadline exceeded";
+        case Trap::CompileError: return "function failed to compile";
+        }
+        return "?";
+    }
+
+    int64_t VM::meter(uint64_t used){
+        charge(used);
+        if (fuel == 0){
+            trap = Trap::OutOfFuel;
+            return 0;
+        }
+        if (deadline == clock::time_point::max())
+            return std::min<uint64_t>(fuel, INT64_MAX);
+        if (clock::now() >= deadline){
+            trap = Trap::Deadline;
+            return 0;
+        }
+        return std::min(fuel, deadline_interval);
+    }
+
+#ifdef GLASS_JIT
+    int VM::run_native(void (*fn)(VM *vm)){
+        native_depth++;
+        for (;;){
+            fn(this);
+            int target = tail_call;
+            if (target < 0)
+                break;
+            tail_call = -1;
+            sp = base;
+            pc = target;
+            std::atomic_signal_fence(std::memory_order_release); // for the sampler, like execute()
+            if (!(fn = jit->hot(*this, target))){
+                native_depth--;
+                return target;
+            }
+        }
+        native_depth--;
+        return -1;
+    }
+#endif
+
+    void VM::enter(int target){
+        int caller = pc;
+        // only read by Samples, Call frames don't have it. native code runs with pc at its
+        // entry (Call and TailCall set it before going native), so this is the function
+        // calling, however it got into its frame
+        push_stack<int>(caller);
+        push_stack<int>(base);
+        push_stack<int>(0); // returning into the sentinel stops execute() right here
+        std::atomic_signal_fence(std::memory_order_release); // for the sampler, like execute()
+        base = sp;
+        pc = target;
+        std::atomic_signal_fence(std::memory_order_release);
+#ifdef GLASS_JIT
+        JIT::Function fn = jit && !metered() && native_depth < max_native_depth ? jit->hot(*this, target) : nullptr;
+        // what native code leaves to a tail call is interpreted in this same frame
+        if (!fn || run_native(fn) >= 0)
+#endif
+            execute();
+        if (trap != Trap::None){
+            stopped_call = caller; // the frame stays for resume() to finish
+            return;
+        }
+        leave(caller);
+    }
+
+    void VM::leave(int caller){
+        sp = base;
+        pop_stack<int>();
+        base = pop_stack<int>();
+        pop_stack<int>();
+        pc = caller;
+        std::atomic_signal_fence(std::memory_order_release);
+    }
+
+    size_t Names::slot(std::string_view name, uint32_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i] != none && (hashes[slots[i]] != hash || strings[slots[i]] != name))
+            i = (i + 1) & mask;
+        return i;
     }
 
-    void IRBuilder::feed(const std::shared_ptr<ASTNode> &node){
-        if (auto funcDecl = std::dynamic_pointer_cast<FuncDeclNode>(node)){
-            emitSymbol(funcDecl->name.value);
-            for (auto &node : funcDecl->block->nodes)
-                feed(node);
+    uint32_t Names::intern(std::string_view name, uint32_t hash){
+        if ((strings.size() + 1) * 2 > slots.size()){
+            slots.assign(std::max<size_t>(slots.size() * 2, 16), none);
+            for (uint32_t id = 0; id < strings.size(); id++)
+                slots[slot(strings[id], hashes[id])] = id;
         }
-        if (auto retStmt = std::dynamic_pointer_cast<RetStmt>(node)){
-            reserve(0);
-            loadExpr(retStmt->expr, 0);
-            release(0);
+        size_t i = slot(name, hash);
+        if (slots[i] == none){
+            slots[i] = strings.size();
+            strings.emplace_back(name);
+            hashes.push_back(hash);
+        }
+        return slots[i];
+    }
+
+    uint32_t Names::find(std::string_view name, uint32_t hash) const {
+        return slots.empty() ? none : slots[slot(name, hash)];
+    }
+
+    void Names::resize(size_t size){
+        // newest first, so nothing interned earlier ever probed past a slot that empties
+        while (strings.size() > size){
+            slots[slot(strings.back(), hashes.back())] = none;
+            strings.pop_back();
+            hashes.pop_back();
+        }
+    }
+
+    std::vector<std::pair<uint32_t, std::string>> IRBuilder::functions() const {
+        std::vector<std::pair<uint32_t, std::string>> entries = {};
+        for (const Hint &hint : hints)
+            entries.push_back({hint.pc, names[hint.name]});
+        for (size_t pc = 0; pc < ir.size(); pc++)
+            if (ir[pc].type == InstructionType::Symbol && ir[pc].imm < names.size())
+                entries.push_back({(uint32_t)pc + 1, names[ir[pc].imm]});
+        std::sort(entries.begin(), entries.end());
+        return entries;
+    }
+
+    void IRBuilder::feed(const Ast &ast){
+        // a new Ast can turn up where the last one was, so don't go by the address
+        folded.clear();
+        folded_for = &ast;
+        for (NodeId node : ast.roots)
+            feed(ast, node);
+    }
+
+    void IRBuilder::rewind(const Mark &m){
+        for (size_t i = shadowed.size(); i-- > m.shadowed;)
+            symbols[shadowed[i].first] = shadowed[i].second;
+        shadowed.resize(m.shadowed);
+        ir.resize(m.ir);
+        constants.resize(m.constants);
+        names.resize(m.names);
+        symbols.resize(std::min(symbols.size(), m.names));
+        hints.resize(m.hints);
+        pending_list.resize(m.pending);
+        errors.resize(m.errors);
+    }
+
+    void IRBuilder::feed(const Ast &ast, NodeId id){
+        if (folded_for != &ast){
+            folded.clear();
+            folded_for = &ast;
+        }
+        folded.resize(ast.nodes.size());
+
+        const ASTNode &node = ast[id];
+        switch (node.kind){
+        case NodeKind::FuncDecl: {
+            emitSymbol(names.intern(node.token.value, node.token.hash));
+            size_t body = ir.size();
+            for (NodeId stmt : ast.children(node.lhs))
+                feed(ast, stmt);
+            // an empty body returns 0 instead of running into whatever comes next
+            if (ir.size() == body || ir.back().type != InstructionType::Return){
+                emitImm(InstructionType::LoadImm, 0, 0);
+                emitEmpty(InstructionType::Return);
+            }
+            break;
+        }
+        case NodeKind::Ret:
+            regs.reset(register_budget);
+            regs.reserve(0);
+            loadExpr(ast, node.lhs, 0);
             emitEmpty(InstructionType::Return);
+            break;
+        default:
+            break;
         }
     }
 
-    uintptr_t IRBuilder::loadExpr(const std::shared_ptr<ExprNode> &expr, int reg){
-        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)){
-            uintptr_t val = strtoull(lit->lit.value.c_str(), NULL, 10);
+    static bool is_pow2(uintptr_t value){
+        return value > 1 && (value & (value - 1)) == 0;
+    }
+
+    auto IRBuilder::fold(const Ast &ast, NodeId id) -> const Folded & {
+        if (folded[id].done)
+            return folded[id];
+        const ASTNode &expr = ast[id];
+        Folded result = { .done = true };
+        switch (expr.kind){
+        case NodeKind::Literal: {
+            const auto &text = expr.token.value;
+            result.constant = true;
+            if (std::from_chars(text.data(), text.data() + text.size(), result.value).ec == std::errc::result_out_of_range)
+                result.value = UINTPTR_MAX;
+            break;
+        }
+        case NodeKind::Ident:
+            // only ever called, never a value. not pure either, so nothing folds a
+            // misplaced one away before loadExpr() reports it
+            result.name = names.intern(expr.token.value, expr.token.hash);
+            result.pure = false;
+            break;
+        case NodeKind::Unary: {
+            Folded operand = fold(ast, expr.lhs);
+            result.pure = operand.pure;
+            result.calls = operand.calls;
+            result.need = operand.need;
+            if (operand.constant && expr.token.type == TokenType::Minus){
+                result.constant = true;
+                result.value = -operand.value;
+            }
+            break;
+        }
+        case NodeKind::Binary: {
+            Folded lhs = fold(ast, expr.lhs), rhs = fold(ast, expr.rhs);
+            result.pure = lhs.pure && rhs.pure;
+            result.calls = lhs.calls || rhs.calls;
+            result.need = lhs.need == rhs.need ? lhs.need + 1 : std::max(lhs.need, rhs.need);
+            // a division that might trap has to stay, even under x * 0
+            if (expr.token.type == TokenType::Slash && !(rhs.constant && rhs.value != 0))
+                result.pure = false;
+            if (lhs.constant && rhs.constant){
+                result.constant = true;
+                switch (expr.token.type){
+                case TokenType::Plus: result.value = lhs.value + rhs.value; break;
+                case TokenType::Minus: result.value = lhs.value - rhs.value; break;
+                case TokenType::Asterisk: result.value = lhs.value * rhs.value; break;
+                case TokenType::Slash:
+                    // leave division by zero to trap at runtime like it always has
+                    result.constant = rhs.value != 0;
+                    if (result.constant)
+                        result.value = lhs.value / rhs.value;
+                    break;
+                default: result.constant = false; break;
+                }
+            } else if (expr.token.type == TokenType::Asterisk && result.pure
+                       && ((lhs.constant && lhs.value == 0) || (rhs.constant && rhs.value == 0))){
+                result.constant = true; // x * 0, nothing to evaluate for side effects
+                result.value = 0;
+            }
+            break;
+        }
+        case NodeKind::FuncCall:
+            result.pure = false;
+            result.calls = true;
+            break;
+        default:
+            break;
+        }
+        if (result.constant)
+            result.need = 1;
+        return folded[id] = result;
+    }
+
+    uintptr_t IRBuilder::loadExpr(const Ast &ast, NodeId id, int reg){
+        const Folded &value = fold(ast, id);
+        if (value.constant){
             if (reg != -1)
-                emitImm(InstructionType::LoadImm, reg, val);
-            return val;
-        } else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)){
-            int rhs_reg = find_free();
-            reserve(rhs_reg);
-            loadExpr(bin->lhs, reg);
-            loadExpr(bin->rhs, rhs_reg);
-            release(rhs_reg);
-            if (bin->op.type == TokenType::Plus){
-                emit(InstructionType::Add, reg, rhs_reg);
-            } else if (bin->op.type == TokenType::Minus){
-                emit(InstructionType::Sub, reg, rhs_reg);
-            } else if (bin->op.type == TokenType::Slash){
-                emit(InstructionType::Div, reg, rhs_reg);
-            } else if (bin->op.type == TokenType::Asterisk){
-                emit(InstructionType::Mul, reg, rhs_reg);
+                emitImm(InstructionType::LoadImm, reg, value.value);
+            return value.value;
+        }
+
+        const ASTNode &expr = ast[id];
+        switch (expr.kind){
+        case NodeKind::Unary:
+            if (reg != -1 && expr.token.type == TokenType::Minus){
+                loadExpr(ast, expr.lhs, reg);
+                emitImm(InstructionType::LoadImm, regs.scratch, 0);
+                emit(InstructionType::Sub, regs.scratch, reg);
+                emit(InstructionType::Move, reg, regs.scratch);
             }
-        } else if (auto call = std::dynamic_pointer_cast<FuncCallExpr>(expr)){
-            emitCtrl(InstructionType::Call, loadExpr(call->func, -1));
-        } else if (auto ident = std::dynamic_pointer_cast<IdentExpr>(expr)) {
-            const auto &id = ident->ident.value;
-            if (symbols.find(id) != symbols.cend()){
-                if (reg != -1)
-                    emitImm(InstructionType::LoadImm, reg, symbols[id]);
-                return symbols[id];
+            break;
+        case NodeKind::Binary:
+            loadBinary(ast, expr, reg);
+            break;
+        case NodeKind::Ident:
+            errors.push_back(Diagnostic { .pos = expr.token.pos, .message = std::string(expr.token.value) + " can only be called, names aren't values" });
+            break;
+        case NodeKind::FuncCall: {
+            // calls leave their result in r0 and clobber everything else
+            const ASTNode &callee = ast[expr.lhs];
+            if (callee.kind != NodeKind::Ident){
+                errors.push_back(Diagnostic { .pos = callee.token.pos, .message = "only functions can be called by name" });
+            } else {
+                const Folded &target = fold(ast, expr.lhs);
+                int entry = entry_of(target.name);
+                if (entry >= 0)
+                    emitCtrl(InstructionType::Call, entry);
+                else // not defined yet, finalize() links it
+                    emitCtrl(InstructionType::Call, target.name, callee.token.pos);
             }
+            if (reg > 0)
+                emit(InstructionType::Move, reg, 0);
+            break;
+        }
+        default:
+            break;
         }
         return -1;
     }
 
+    void IRBuilder::loadBinary(const Ast &ast, const ASTNode &expr, int reg){
+        TokenType op = expr.token.type;
+        Folded lhs = fold(ast, expr.lhs), rhs = fold(ast, expr.rhs);
+
+        // x + 0, x - 0, 0 + x, x * 1, 1 * x, x / 1
+        if (rhs.constant && ((rhs.value == 0 && (op == TokenType::Plus || op == TokenType::Minus))
+                             || (rhs.value == 1 && (op == TokenType::Asterisk || op == TokenType::Slash)))){
+            loadExpr(ast, expr.lhs, reg);
+            return;
+        }
+        if (lhs.constant && ((lhs.value == 0 && op == TokenType::Plus)
+                             || (lhs.value == 1 && op == TokenType::Asterisk))){
+            loadExpr(ast, expr.rhs, reg);
+            return;
+        }
+
+        // multiplying or (unsigned) dividing by a power of two is a shift
+        bool rhs_shift = rhs.constant && is_pow2(rhs.value) && (op == TokenType::Asterisk || op == TokenType::Slash);
+        bool lhs_shift = lhs.constant && is_pow2(lhs.value) && op == TokenType::Asterisk;
+        if (rhs_shift || lhs_shift){
+            loadExpr(ast, rhs_shift ? expr.lhs : expr.rhs, reg);
+            emitImm(InstructionType::LoadImm, regs.scratch, __builtin_ctzll(rhs_shift ? rhs.value : lhs.value));
+            emit(op == TokenType::Slash ? InstructionType::Shr : InstructionType::Shl, reg, regs.scratch);
+            return;
+        }
+
+        InstructionType type;
+        if (op == TokenType::Plus){
+            type = InstructionType::Add;
+        } else if (op == TokenType::Minus){
+            type = InstructionType::Sub;
+        } else if (op == TokenType::Slash){
+            type = InstructionType::Div;
+        } else if (op == TokenType::Asterisk){
+            type = InstructionType::Mul;
+        } else {
+            return;
+        }
+        bool commutative = type == InstructionType::Add || type == InstructionType::Mul;
+
+        // Sethi-Ullman: start with the side that needs more registers. a side with calls
+        // goes first regardless, since nothing can stay in a register across it
+        bool rhs_first = lhs.calls != rhs.calls ? rhs.calls : rhs.need > lhs.need;
+        if (rhs_first){
+            int t = regs.alloc();
+            if (t != -1){
+                loadExpr(ast, expr.rhs, t);
+                if (!lhs.calls && lhs.need - 1 <= regs.available()){
+                    loadExpr(ast, expr.lhs, reg);
+                    emit(type, reg, t);
+                    regs.release(t);
+                    return;
+                }
+                int slot = spill(t);
+                regs.release(t);
+                loadExpr(ast, expr.lhs, reg);
+                unspill(regs.scratch, slot);
+                emit(type, reg, regs.scratch);
+                return;
+            }
+        }
+
+        loadExpr(ast, expr.lhs, reg);
+        if (!rhs.calls && rhs.need <= regs.available()){
+            int t = regs.alloc();
+            loadExpr(ast, expr.rhs, t);
+            emit(type, reg, t);
+            regs.release(t);
+            return;
+        }
+
+        // the rhs calls something or needs every register, keep the lhs on the stack meanwhile
+        int slot = spill(reg);
+        loadExpr(ast, expr.rhs, reg);
+        unspill(regs.scratch, slot);
+        if (commutative){
+            emit(type, reg, regs.scratch);
+        } else {
+            emit(type, regs.scratch, reg);
+            emit(InstructionType::Move, reg, regs.scratch);
+        }
+    }
+
 }
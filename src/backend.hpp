@@ -1,15 +1,21 @@
 #ifndef __BACKEND_HPP__
 #define __BACKEND_HPP__
+#include <chrono>
 #include <memory>
 #include <vector>
-#include <variant>
 #include <stdint.h>
 #include <unordered_map>
+#include <algorithm>
 #include <string>
+#include "lexer.hpp"
 
 namespace glass {
-    class ASTNode;
-    class ExprNode;
+    class Ast;
+    struct ASTNode;
+    using NodeId = uint32_t;
+    class JIT;
+    class Profile;
+    class Samples;
 
     enum class InstructionType : unsigned char {
         Push, // does not push a value, it decrements the sp
@@ -23,6 +29,8 @@ namespace glass {
         LoadLong,
         LoadPtr,
         LoadImm,
+        LoadConst, // immediates that don't fit in 32 bits
+        Move,
 
         StrByte,
         StrHalf,
@@ -32,142 +40,424 @@ namespace glass {
 
         // operations
         Add, Sub, Mul, Div,
+        Shl, Shr,
+
+        // superinstructions, only produced by IRBuilder::optimize()
+        AddImm, SubImm, MulImm, DivImm,
+        ShlImm, ShrImm,
+        LoadStack, // LoadLong from base - imm
+        StrStack,  // StrLong to base - imm
 
         Halt, // interactive only for REPL so it can exit without modifying stack
 
         // control flow
         Call,
+        TailCall, // return f(): f takes over the caller's frame, so it's a jump
         Return,
+        LoadImmReturn,
+        Compile, // a function Lazy hasn't compiled yet, calls land here first
 
         // hints
         Symbol
     };
 
+    // packed fixed-width instruction. every opcode has one operand layout, so
+    // decoding is just reading fields:
+    //   Add/Sub/Mul/Div/Shl/Shr   dst, src
+    //   AddImm..ShrImm            dst, imm
+    //   Move                      dst, src
+    //   LoadImm/Push/Pop/AddrStack dst, imm
+    //   LoadStack/StrStack        dst, imm = offset below base
+    //   LoadImmReturn             dst, imm
+    //   LoadConst                 dst, imm = index into the constant table
+    //   Load*/Str*                dst, src = base register, imm = signed offset
+    //   Call/TailCall             dst = condition register, imm = new pc
+    //   Compile                   imm = index of the function in its Lazy
+    //   Symbol                    imm = index into the name table
     struct Instruction {
         InstructionType type;
+        unsigned char dst = 0;
+        unsigned char src = 0;
+        unsigned char reserved = 0;
+        uint32_t imm = 0;
+    };
+    static_assert(sizeof(Instruction) == 8, "instructions must stay 8 bytes");
 
-        struct R {
-            unsigned char dst;
-            unsigned char src;
-        };
-        struct I {
-            unsigned char dst;
-            uintptr_t value;
-        };
-        struct M {
-            unsigned char dst;
-            unsigned char base;
-            uintptr_t index;
-        };
-        struct B {
-            unsigned char cond;
-            uintptr_t new_pc;
-        };
-        struct empty {};
+    const char *instruction_name(InstructionType type);
 
-        std::variant<R, I, M, B, empty, std::string> data = empty {};
+    // every distinct name a program mentions, each with a small id. ids are handed
+    // out in order, so the symbol table is just a vector indexed by id
+    class Names {
+    public:
+        static constexpr uint32_t none = UINT32_MAX;
+
+        // the id of name, a new one if it's the first time. hash is hash_name(name),
+        // which the lexer already worked out for identifiers
+        uint32_t intern(std::string_view name, uint32_t hash);
+        uint32_t intern(std::string_view name){
+            return intern(name, hash_name(name));
+        }
+        // none if name was never interned
+        uint32_t find(std::string_view name, uint32_t hash) const;
+        uint32_t find(std::string_view name) const {
+            return find(name, hash_name(name));
+        }
+        // forgets every name interned after the first size
+        void resize(size_t size);
+
+        const std::string &operator[](uint32_t id) const {
+            return strings[id];
+        }
+        size_t size() const {
+            return strings.size();
+        }
+
+    private:
+        std::vector<std::string> strings = {};
+        std::vector<uint32_t> hashes = {};
+        std::vector<uint32_t> slots = {}; // open addressing, ids or none
+
+        size_t slot(std::string_view name, uint32_t hash) const;
     };
 
     class IRBuilder {
     public:
         std::vector<Instruction> ir = {};
-        std::unordered_map<std::string, int> symbols = {};
+        std::vector<uintptr_t> constants = {};
+        Names names = {};
+        std::vector<int> symbols = {}; // entry point by name id, -1 where nothing is defined
+
+        // where each function starts, once optimize() has taken the Symbol hints out of ir
+        struct Hint {
+            uint32_t pc;
+            uint32_t name; // id in names
+        };
+        std::vector<Hint> hints = {};
 
-        void feed(const std::shared_ptr<ASTNode> &node);
-        void finalize(){
+        // registers expressions may use, including one kept back for spilling.
+        // anything that doesn't fit gets parked on the VM stack.
+        unsigned register_budget = 16;
+        // optimize() copies callees of at most this many instructions into their
+        // callers, 0 turns it off
+        unsigned inline_limit = 8;
+
+        // what feed() and finalize() found wrong, the ir is no good if there's anything here
+        std::vector<Diagnostic> errors = {};
+
+        void feed(const Ast &ast);
+        void feed(const Ast &ast, NodeId node);
+        // links calls to functions that were used before (or without) being defined.
+        // false if some were never defined, errors says which. what got linked is
+        // done with, so feeding more and finalizing again only links the new code
+        bool finalize(){
             for (const Pending &pending : pending_list){
-                Instruction &ins = ir[pending.pos];
-                auto &data = ins.data;
-                // I?
-                if (data.index() == 1){
-                    std::get<Instruction::I>(data).value = symbols[pending.what];
-                } else if (data.index() == 3) { // B?
-                    std::get<Instruction::B>(data).new_pc = symbols[pending.what];
+                int entry = entry_of(pending.name);
+                if (entry < 0){
+                    errors.push_back(Diagnostic { .pos = pending.at, .message = "undefined function " + names[pending.name] });
+                    continue;
                 }
+                ir[pending.pos].imm = entry;
             }
+            if (errors.empty())
+                pending_list.clear();
+            return errors.empty();
+        }
+        // peephole pass over the finalized ir: inlines small functions, moves Symbol
+        // hints into hints and fuses common pairs into superinstructions (return f()
+        // into a TailCall among them), fixing up Call targets and symbols after.
+        // only touches ir from from on, code before it has to be optimized already
+        void optimize(size_t from = 0);
+        // drops every function that entries can't reach and lays out the rest so each
+        // comes right after the caller calling it most, fixing up calls, symbols,
+        // hints, names and constants. for a finished program, after optimize().
+        // false if one of entries isn't defined, nothing changes then
+        bool shake(const std::vector<std::string> &entries);
+
+        // a point to wind feed() back to, for building a program up a piece at a time
+        // (see Session) and dropping a piece that doesn't compile
+        struct Mark {
+            size_t ir, constants, names, hints, pending, errors, shadowed;
+        };
+        Mark mark() const {
+            return Mark { ir.size(), constants.size(), names.size(), hints.size(), pending_list.size(), errors.size(), shadowed.size() };
         }
+        // forgets everything fed since m, functions it defined included. only until
+        // optimize() has been over it
+        void rewind(const Mark &m);
+        // entry point of the function called name, -1 if there isn't one
+        int entry(std::string_view name) const {
+            return entry_of(names.find(name));
+        }
+        int entry_of(uint32_t name) const {
+            return name < symbols.size() ? symbols[name] : -1;
+        }
+        // every function's entry pc and name, sorted by pc. taken from hints and from any
+        // Symbol still in ir, so it works before and after optimize()
+        std::vector<std::pair<uint32_t, std::string>> functions() const;
     private:
-        bool clobbers[256];
+        // free-list over the register budget, one bit per register. the last
+        // register is never handed out, spills and short sequences use it.
+        class Registers {
+        public:
+            int scratch = 1;
+
+            void reset(unsigned budget){
+                budget = std::clamp(budget, 2u, 256u);
+                scratch = budget - 1;
+                for (int i = 0; i < 4; i++){
+                    int lo = i * 64;
+                    free_bits[i] = scratch <= lo ? 0 : scratch >= lo + 64 ? ~(uint64_t)0 : ((uint64_t)1 << (scratch - lo)) - 1;
+                }
+            }
+
+            // lowest free register, -1 once the budget is used up
+            int alloc(){
+                for (int i = 0; i < 4; i++){
+                    if (free_bits[i]){
+                        int r = i * 64 + __builtin_ctzll(free_bits[i]);
+                        reserve(r);
+                        return r;
+                    }
+                }
+                return -1;
+            }
+
+            void reserve(int r){
+                free_bits[r / 64] &= ~((uint64_t)1 << (r % 64));
+            }
+
+            void release(int r){
+                free_bits[r / 64] |= (uint64_t)1 << (r % 64);
+            }
+
+            unsigned available() const {
+                unsigned n = 0;
+                for (uint64_t bits : free_bits)
+                    n += __builtin_popcountll(bits);
+                return n;
+            }
+
+        private:
+            uint64_t free_bits[4] = {};
+        };
+
+        Registers regs = {};
+        int spill_depth = 0;
+
+        // what fold() knows about a node, memoized so folding stays linear in the tree
+        struct Folded {
+            bool done = false;
+            bool constant = false;
+            bool pure = true;   // nothing below calls or might trap
+            bool calls = false; // something below clobbers every register
+            unsigned need = 1;  // registers to evaluate it without spilling (Sethi-Ullman)
+            uintptr_t value = 0;
+            uint32_t name = Names::none; // an Ident's id
+        };
+        std::vector<Folded> folded = {};
+        const Ast *folded_for = nullptr;
+
+        const Folded &fold(const Ast &ast, NodeId id);
 
         struct Pending {
             uintptr_t pos;
-            std::string what;
+            uint32_t name;
+            size_t at; // where the source mentions it
         };
 
         std::vector<Pending> pending_list = {};
+        // the entry every emitSymbol replaced (-1 for none), for rewind()
+        std::vector<std::pair<uint32_t, int>> shadowed = {};
 
-        int find_free(){
-            for (int i = 0; i < 256; i++){
-                if (!clobbers[i]) return i;
-            }
-            return -1;
+        // parks r in a fresh slot below base, slots are released in reverse order
+        int spill(int r){
+            int slot = spill_depth++;
+            emitImm(InstructionType::Push, 0, 8);
+            emitImm(InstructionType::AddrStack, regs.scratch, 8 * (slot + 1));
+            emitMem(InstructionType::StrLong, r, regs.scratch, 0);
+            return slot;
         }
 
-        void reserve(unsigned char r){
-            clobbers[r] = true;
-        }
-        
-        void release(unsigned char r){
-            clobbers[r] = false;
+        void unspill(int r, int slot){
+            emitImm(InstructionType::AddrStack, regs.scratch, 8 * (slot + 1));
+            emitMem(InstructionType::LoadLong, r, regs.scratch, 0);
+            emitImm(InstructionType::Pop, 0, 8);
+            spill_depth--;
         }
 
-        void emitSymbol(const std::string &str){
-            symbols[str] = ir.size() + 1;
-            ir.push_back(Instruction { .type = InstructionType::Symbol, .data = str });
+        void emitSymbol(uint32_t name){
+            if (symbols.size() <= name)
+                symbols.resize(names.size(), -1);
+            shadowed.push_back({name, symbols[name]});
+            symbols[name] = ir.size() + 1;
+            ir.push_back(Instruction { .type = InstructionType::Symbol, .imm = name });
         }
         void emitEmpty(InstructionType type){
-            ir.push_back(Instruction { .type = type, .data = Instruction::empty {} });
+            ir.push_back(Instruction { .type = type });
         }
         void emitImm(InstructionType type, unsigned char dst, uintptr_t value){
-            ir.push_back(Instruction { .type = type, .data = Instruction::I { .dst = dst, .value = value }});
-        }
-        void emitImm(InstructionType type, unsigned char dst, const std::string &value){
-            ir.push_back(Instruction { .type = type, .data = Instruction::I { .dst = dst, .value = 0 } });
-            pending_list.push_back(Pending { .pos = ir.size() - 1, .what = value });
+            if (type == InstructionType::LoadImm && value > UINT32_MAX){
+                constants.push_back(value);
+                type = InstructionType::LoadConst;
+                value = constants.size() - 1;
+            }
+            ir.push_back(Instruction { .type = type, .dst = dst, .imm = (uint32_t)value });
         }
         void emit(InstructionType type, unsigned char dst, unsigned char src){
-            ir.push_back(Instruction { .type = type, .data = Instruction::R { .dst = dst, .src = src } });
+            ir.push_back(Instruction { .type = type, .dst = dst, .src = src });
+        }
+        void emitMem(InstructionType type, unsigned char dst, unsigned char base, int32_t offset){
+            ir.push_back(Instruction { .type = type, .dst = dst, .src = base, .imm = (uint32_t)offset });
         }
         void emitCtrl(InstructionType type, uintptr_t value, unsigned char cond = 255){
-            ir.push_back(Instruction { .type = type, .data = Instruction::B { .cond = cond, .new_pc = value } });
+            ir.push_back(Instruction { .type = type, .dst = cond, .imm = (uint32_t)value });
         }
-        void emitCtrl(InstructionType type, const std::string &value, unsigned char cond = 255){
-            ir.push_back(Instruction { .type = type, .data = Instruction::B { .cond = cond, .new_pc = 0 } });
-            pending_list.push_back(Pending { .pos = ir.size() - 1, .what = value });
+        void emitCtrl(InstructionType type, uint32_t name, size_t at, unsigned char cond = 255){
+            ir.push_back(Instruction { .type = type, .dst = cond });
+            pending_list.push_back(Pending { .pos = ir.size() - 1, .name = name, .at = at });
         }
 
 
-        uintptr_t loadExpr(const std::shared_ptr<ExprNode> &expr, int reg);
+        uintptr_t loadExpr(const Ast &ast, NodeId expr, int reg);
+        void loadBinary(const Ast &ast, const ASTNode &expr, int reg);
+        void inline_calls(size_t from);
     };
 
-    // this is literally a VM.
+    class VMPool;
+    class Lazy;
+
+    // the code and constants of a finalized program. immutable, so any number of VMs
+    // on any number of threads share one through a shared_ptr instead of each keeping
+    // a copy. it owns its vectors, or points into memory it keeps alive (a mapped .glc)
+    class Program {
+    public:
+        const Instruction *code = nullptr;
+        size_t size = 0;
+        const uintptr_t *constants = nullptr;
+        size_t constant_count = 0;
+
+        static std::shared_ptr<const Program> make(std::vector<Instruction> code, std::vector<uintptr_t> constants = {}){
+            std::shared_ptr<Program> program(new Program());
+            program->owned_code = std::move(code);
+            program->owned_constants = std::move(constants);
+            program->code = program->owned_code.data();
+            program->size = program->owned_code.size();
+            program->constants = program->owned_constants.data();
+            program->constant_count = program->owned_constants.size();
+            return program;
+        }
+
+        static std::shared_ptr<const Program> view(const Instruction *code, size_t size, const uintptr_t *constants,
+                                                   size_t constant_count, std::shared_ptr<const void> owner){
+            std::shared_ptr<Program> program(new Program());
+            program->code = code;
+            program->size = size;
+            program->constants = constants;
+            program->constant_count = constant_count;
+            program->owner = std::move(owner);
+            return program;
+        }
+
+        const Instruction &operator[](size_t pc) const {
+            return code[pc];
+        }
+
+    private:
+        Program() = default;
+
+        std::vector<Instruction> owned_code = {};
+        std::vector<uintptr_t> owned_constants = {};
+        std::shared_ptr<const void> owner = {};
+    };
+
+    // why run() or call() gave up on a program
+    enum class Trap : unsigned char {
+        None,
+        StackOverflow, // ran into the guard below the stack
+        OutOfFuel,     // used up VM::fuel, resumable
+        Deadline,      // ran past VM::deadline, resumable
+        CompileError,  // a function Lazy compiled on its first call didn't, see Lazy::failure
+    };
+
+    const char *trap_message(Trap trap);
+
+    // this is literally a VM. move-only, since it owns its stack.
     class VM {
     public:
-        std::vector<Instruction> program = {};
+        // reserved up front but only backed by memory once touched, with a guard
+        // below it. overflowing faults into the guard and comes back as a Trap,
+        // so pushes never need a bounds check
+        static constexpr int stack_size = 8 << 20;
+
+        std::shared_ptr<const Program> program = {};
+        // where run() starts. while running it only follows Call, TailCall and Return,
+        // so it always points into the current function (see Samples)
         int pc = 0;
-        bool should_exit = false;
         char *stack;
         int sp;
         int base;
         uintptr_t registers[256];
+        JIT *jit = nullptr; // optional, hot functions get compiled through it
+#ifdef GLASS_PROFILE
+        Profile *profile = nullptr; // optional, counts and times everything interpreted
+#endif
+        Samples *samples = nullptr; // optional, filled in by the sampling profiler
+        Lazy *lazy = nullptr; // set when program came from a Lazy, which fills in the stubs
+        Trap trap = Trap::None;
 
-        VM(){
-            stack = new char[65536];
-            reset();
-        }
+        // limits for code that isn't trusted to finish, both off by default. they're
+        // only checked at Call, TailCall and Return, between which code runs straight,
+        // so a run can go over by one stretch of straight code but costs nothing per
+        // instruction. running out stops the VM where it is with Trap::OutOfFuel or
+        // Trap::Deadline: raise the limit and resume(), or reset(). metered code is
+        // always interpreted, jitted code isn't counted
+        using clock = std::chrono::steady_clock;
+        static constexpr uint64_t unlimited = UINT64_MAX;
+        uint64_t fuel = unlimited; // instructions left to run
+        clock::time_point deadline = clock::time_point::max();
 
+        // a VM with its own stack, see VMPool for making lots of them
+        VM();
+        VM(VM &&other) noexcept;
+        VM &operator=(VM &&other) noexcept;
+        VM(const VM &) = delete;
+        VM &operator=(const VM &) = delete;
+        ~VM();
+
+        // O(1). registers other than the result aren't cleared: code from IRBuilder
+        // always writes a register before reading it, and a 2 KB memset would be
+        // most of the cost of recycling a pooled VM
         void reset(){
-            base = sp = 65536;
+            sp = stack_size;
             pc = 0;
-            should_exit = false;
+            // the entry point's frame, returning into the 0 stops run()
             push_stack<int>(0);
+            base = sp;
+            registers[0] = 0;
+            trap = Trap::None;
+            native_depth = 0;
+            stopped_call = -1;
+            resuming = false;
+            tail_call = -1;
         }
 
-        ~VM(){
-            delete[] stack;
+        // runs from pc until Halt or a Return from the entry point. false if the
+        // program trapped, the VM is reset then and trap says why
+        bool run();
+        // calls the function at target and returns once it does, for native code and
+        // embedders. traps the same way run() does
+        bool call(int target);
+        // carries on with a run() or call() that ran out of fuel or time, as if it had
+        // never stopped. false if it stops or traps again
+        bool resume();
+
+        bool metered() const {
+            return fuel != unlimited || deadline != clock::time_point::max();
         }
 
-        void step();
+        // the VM inside run() or call() on this thread, null if there is none.
+        // async-signal-safe
+        static const VM *current();
 
         template <typename T>
         T get_stack(int offset){
@@ -177,7 +467,7 @@ namespace glass {
         template <typename T>
         T pop_stack(){
             T value = get_stack<T>(0);
-            sp -= sizeof(T);
+            sp += sizeof(T);
             return value;
         }
 
@@ -186,6 +476,83 @@ namespace glass {
             sp -= sizeof(T);
             *(T*)&stack[sp] = value;
         }
+
+    private:
+        friend class VMPool;
+        friend class JIT;
+        VMPool *pool = nullptr; // where the stack goes back to, null if the VM mapped it itself
+
+        // jitted functions call each other through the native stack, past this depth
+        // calls stay interpreted so deep recursion runs out of VM stack (a Trap) first
+        static constexpr int max_native_depth = 4096;
+        int native_depth = 0;
+        // jitted code returns with the target of its TailCall here instead of calling
+        // it, so the callee can take over the frame. -1 when it really returned
+        int tail_call = -1;
+        // with a deadline, the clock is looked at every this many instructions
+        static constexpr uint64_t deadline_interval = 1 << 16;
+        int stopped_call = -1; // the pc call() returns to when a stopped call() finishes
+        bool resuming = false; // the next execute() picks up from a stop instead of a call
+
+
+        VM(VMPool *pool, char *stack);
+        void release_stack();
+
+        // run() and call() without catching traps
+        void execute();
+        // runs native code in the current frame, and what it tail calls for as long as
+        // that's native too. -1 once the frame has returned, otherwise the pc to go on
+        // interpreting from in the same frame
+        int run_native(void (*fn)(VM *vm));
+        void enter(int target);
+        void leave(int caller);
+        // takes used instructions off fuel, then how many may run before the next
+        // check. 0 with trap set if it's time to stop
+        int64_t meter(uint64_t used);
+        void charge(uint64_t used){
+            if (fuel != unlimited)
+                fuel -= std::min(fuel, used);
+        }
+        template <typename Body>
+        bool guarded(Body &&body);
+        // leaves run() or call() from however deep in, native frames and all, like
+        // a stack overflow does. the VM is reset with trap set to why
+        [[noreturn]] void unwind(Trap why);
+    };
+
+    // hands out VMs whose stacks are carved out of shared slabs, each stack with
+    // a guard page below it. destroying a VM puts its stack back on the free list,
+    // so once warmed up, acquiring and dropping a VM costs no syscalls and no
+    // allocation. not thread-safe, use one pool per thread; it has to outlive its VMs.
+    class VMPool {
+    public:
+        explicit VMPool(size_t stacks_per_slab = 16) : stacks_per_slab(std::max<size_t>(stacks_per_slab, 1)) {}
+        ~VMPool();
+
+        VMPool(const VMPool &) = delete;
+        VMPool &operator=(const VMPool &) = delete;
+
+        VM acquire();
+
+        size_t allocated() const {
+            return slabs.size() * stacks_per_slab;
+        }
+
+    private:
+        friend class VM;
+
+        struct Slab {
+            void *mem;
+            size_t length;
+        };
+
+        size_t stacks_per_slab;
+        std::vector<Slab> slabs = {};
+        std::vector<char *> free_stacks = {};
+
+        void recycle(char *stack){
+            free_stacks.push_back(stack);
+        }
     };
 }
 
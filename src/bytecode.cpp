@@ -0,0 +1,284 @@
+#include "bytecode.hpp"
+#include "backend.hpp"
+#include "stack.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+
+namespace glass {
+    namespace {
+        struct SymbolEntry {
+            uint32_t name;
+            uint32_t entry;
+        };
+
+        struct NameEntry {
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        template <typename T>
+        void append(std::vector<unsigned char> &out, const T *values, size_t count){
+            const unsigned char *p = (const unsigned char *)values;
+            out.insert(out.end(), p, p + count * sizeof(T));
+        }
+
+        // steps over count Ts in bytes at pos, false if they run past the end
+        template <typename T>
+        bool skip(std::string_view bytes, size_t &pos, size_t count){
+            if (count > (bytes.size() - pos) / sizeof(T))
+                return false;
+            pos += count * sizeof(T);
+            return true;
+        }
+
+        // reads count Ts from bytes at pos, false if they run past the end
+        template <typename T>
+        bool take(std::string_view bytes, size_t &pos, size_t count, std::vector<T> &out){
+            if (count > (bytes.size() - pos) / sizeof(T))
+                return false;
+            out.resize(count);
+            if (count)
+                memcpy(out.data(), bytes.data() + pos, count * sizeof(T));
+            pos += count * sizeof(T);
+            return true;
+        }
+    }
+
+    uint64_t hash_source(std::string_view text){
+        uint64_t hash = 0xcbf29ce484222325;
+        for (unsigned char c : text){
+            hash ^= c;
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    std::vector<unsigned char> write_bytecode(const IRBuilder &builder, uint64_t source_hash){
+        std::vector<SymbolEntry> symbols = {};
+        for (uint32_t name = 0; name < builder.symbols.size(); name++)
+            if (builder.symbols[name] >= 0)
+                symbols.push_back(SymbolEntry { .name = name, .entry = (uint32_t)builder.symbols[name] });
+        std::vector<NameEntry> names = {};
+        std::string text = {};
+        for (uint32_t name = 0; name < builder.names.size(); name++){
+            names.push_back(NameEntry { .offset = (uint32_t)text.size(), .length = (uint32_t)builder.names[name].size() });
+            text += builder.names[name];
+        }
+
+        BytecodeHeader header = {
+            .magic = {},
+            .version = bytecode_version,
+            .source_hash = source_hash,
+            .instructions = (uint32_t)builder.ir.size(),
+            .constants = (uint32_t)builder.constants.size(),
+            .names = (uint32_t)names.size(),
+            .symbols = (uint32_t)symbols.size(),
+            .hints = (uint32_t)builder.hints.size(),
+            .text = (uint32_t)text.size(),
+        };
+        memcpy(header.magic, bytecode_magic, sizeof(header.magic));
+
+        std::vector<unsigned char> out = {};
+        append(out, &header, 1);
+        append(out, builder.ir.data(), builder.ir.size());
+        append(out, builder.constants.data(), builder.constants.size());
+        append(out, names.data(), names.size());
+        append(out, symbols.data(), symbols.size());
+        append(out, builder.hints.data(), builder.hints.size());
+        append(out, text.data(), text.size());
+        return out;
+    }
+
+    namespace {
+        // a checked module with everything but the code and constants read out. those
+        // stay in bytes, possibly unaligned
+        struct Module {
+            IRBuilder builder;
+            const char *code;
+            size_t instructions;
+            const char *constants;
+            size_t constant_count;
+        };
+
+        std::optional<Module> read_module(std::string_view bytes, uint64_t *source_hash){
+            BytecodeHeader header;
+            if (bytes.size() < sizeof(header))
+                return {};
+            memcpy(&header, bytes.data(), sizeof(header));
+            if (memcmp(header.magic, bytecode_magic, sizeof(header.magic)) != 0 || header.version != bytecode_version)
+                return {};
+
+            Module module = {};
+            IRBuilder &builder = module.builder;
+            std::vector<NameEntry> names = {};
+            std::vector<SymbolEntry> symbols = {};
+            std::vector<char> text = {};
+            size_t pos = sizeof(header);
+            module.code = bytes.data() + pos;
+            module.instructions = header.instructions;
+            if (!skip<Instruction>(bytes, pos, header.instructions))
+                return {};
+            module.constants = bytes.data() + pos;
+            module.constant_count = header.constants;
+            if (!skip<uintptr_t>(bytes, pos, header.constants)
+                || !take(bytes, pos, header.names, names)
+                || !take(bytes, pos, header.symbols, symbols)
+                || !take(bytes, pos, header.hints, builder.hints)
+                || !take(bytes, pos, header.text, text)
+                || pos != bytes.size())
+                return {};
+
+            // a bad cache file shouldn't be able to send the VM off the end of the code, the
+            // constants or the stack. pointers in registers are the program's business, a
+            // module is trusted as far as that goes
+            std::vector<bool> entries(header.instructions, false);
+            if (header.instructions)
+                entries[0] = true;
+            for (size_t pc = 0; pc < header.instructions; pc++){
+                Instruction ins;
+                memcpy(&ins, module.code + pc * sizeof(Instruction), sizeof(ins));
+                if (ins.type > InstructionType::Symbol || ins.type == InstructionType::Compile)
+                    return {};
+                // no further below base than the guard reaches, so the worst is a StackOverflow.
+                // how far sp gets is checked for the whole function below
+                if ((ins.type == InstructionType::Push || ins.type == InstructionType::Pop || ins.type == InstructionType::AddrStack
+                     || ins.type == InstructionType::LoadStack || ins.type == InstructionType::StrStack)
+                    && ins.imm > stack_guard - 8)
+                    return {};
+                if (ins.type == InstructionType::Call || ins.type == InstructionType::TailCall){
+                    if (ins.imm >= header.instructions)
+                        return {};
+                    entries[ins.imm] = true;
+                }
+                if (ins.type == InstructionType::LoadConst && ins.imm >= header.constants)
+                    return {};
+                if (ins.type == InstructionType::Symbol && ins.imm >= header.names)
+                    return {};
+            }
+            // every function runs until one of these, so nothing falls off the end
+            if (header.instructions){
+                Instruction last;
+                memcpy(&last, module.code + (header.instructions - 1) * sizeof(Instruction), sizeof(last));
+                if (last.type != InstructionType::Return && last.type != InstructionType::LoadImmReturn
+                    && last.type != InstructionType::TailCall && last.type != InstructionType::Halt)
+                    return {};
+            }
+            for (const NameEntry &name : names){
+                if (name.offset > text.size() || name.length > text.size() - name.offset)
+                    return {};
+                // ids are handed out in order, a name that's in there twice would break that
+                if (builder.names.intern(std::string_view(text.data() + name.offset, name.length)) != builder.names.size() - 1)
+                    return {};
+            }
+            builder.symbols.assign(header.names, -1);
+            for (const SymbolEntry &symbol : symbols){
+                if (symbol.name >= header.names || symbol.entry >= header.instructions)
+                    return {};
+                builder.symbols[symbol.name] = symbol.entry;
+                entries[symbol.entry] = true;
+            }
+            for (const IRBuilder::Hint &hint : builder.hints){
+                if (hint.name >= header.names || hint.pc >= header.instructions)
+                    return {};
+                entries[hint.pc] = true;
+            }
+
+            // code runs straight from wherever it's entered to the next terminator, so walking
+            // back from each one gives the deepest and shallowest sp gets below base from any
+            // pc. from an entry it must stay within the guard's reach and never go above base,
+            // where a Call would write over the caller's frame or past the top of the stack
+            int64_t deepest = 0, shallowest = 0;
+            for (size_t pc = header.instructions; pc-- > 0;){
+                Instruction ins;
+                memcpy(&ins, module.code + pc * sizeof(Instruction), sizeof(ins));
+                if (ins.type == InstructionType::Return || ins.type == InstructionType::LoadImmReturn
+                    || ins.type == InstructionType::TailCall || ins.type == InstructionType::Halt){
+                    deepest = shallowest = 0;
+                } else if (ins.type == InstructionType::Push || ins.type == InstructionType::Pop){
+                    int64_t delta = ins.type == InstructionType::Push ? (int64_t)ins.imm : -(int64_t)ins.imm;
+                    deepest = std::max<int64_t>(0, delta + deepest);
+                    shallowest = std::min<int64_t>(0, delta + shallowest);
+                }
+                if (entries[pc] && (deepest > (int64_t)(stack_guard - 8) || shallowest < 0))
+                    return {};
+            }
+
+            if (source_hash)
+                *source_hash = header.source_hash;
+            return module;
+        }
+
+        template <typename T>
+        std::vector<T> copy_out(const char *from, size_t count){
+            std::vector<T> out(count);
+            if (count)
+                memcpy(out.data(), from, count * sizeof(T));
+            return out;
+        }
+    }
+
+    std::optional<IRBuilder> read_bytecode(std::string_view bytes, uint64_t *source_hash){
+        auto module = read_module(bytes, source_hash);
+        if (!module)
+            return {};
+        module->builder.ir = copy_out<Instruction>(module->code, module->instructions);
+        module->builder.constants = copy_out<uintptr_t>(module->constants, module->constant_count);
+        return std::move(module->builder);
+    }
+
+    std::optional<MappedBytecode> map_bytecode(const Source &source, uint64_t *source_hash){
+        auto module = read_module(source.text(), source_hash);
+        if (!module)
+            return {};
+        MappedBytecode mapped = { .builder = std::move(module->builder), .program = nullptr };
+        if ((uintptr_t)module->code % alignof(Instruction) == 0 && (uintptr_t)module->constants % alignof(uintptr_t) == 0){
+            mapped.program = Program::view((const Instruction *)module->code, module->instructions,
+                                           (const uintptr_t *)module->constants, module->constant_count, source.share());
+        } else {
+            mapped.program = Program::make(copy_out<Instruction>(module->code, module->instructions),
+                                            copy_out<uintptr_t>(module->constants, module->constant_count));
+        }
+        return mapped;
+    }
+
+    std::optional<std::string> cache_path(uint64_t source_hash){
+        std::string dir;
+        if (const char *env = getenv("GLASS_CACHE_DIR"); env && *env)
+            dir = env;
+        else if (const char *env = getenv("XDG_CACHE_HOME"); env && *env)
+            dir = std::string(env) + "/glass";
+        else if (const char *env = getenv("HOME"); env && *env)
+            dir = std::string(env) + "/.cache/glass";
+        else
+            return {};
+
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.glc", (unsigned long long)source_hash);
+        return dir + name;
+    }
+
+    bool write_file_atomic(const std::string &path, const std::vector<unsigned char> &bytes){
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+        static std::atomic<unsigned> serial = 0;
+        std::string tmp = path + "." + std::to_string(getpid()) + "." + std::to_string(serial++) + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            if (!out.write((const char *)bytes.data(), bytes.size())){
+                out.close();
+                unlink(tmp.c_str());
+                return false;
+            }
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0){
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+}
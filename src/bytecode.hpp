@@ -0,0 +1,56 @@
+#ifndef __BYTECODE_HPP__
+#define __BYTECODE_HPP__
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include "backend.hpp"
+
+namespace glass {
+
+    // .glc modules: a finalized program as it sits in memory, so loading one is
+    // a few bounds checks and copies instead of lexing, parsing and codegen.
+    //   header, instructions, constants, names, symbols, hints, name text
+    // everything is native-endian and 8-byte aligned up to the name text.
+    struct BytecodeHeader {
+        char magic[4];
+        // bump whenever the layout, the opcodes or the code IRBuilder emits change,
+        // cached modules from older builds are then recompiled instead of run
+        uint32_t version;
+        uint64_t source_hash;
+        uint32_t instructions;
+        uint32_t constants;
+        uint32_t names;
+        uint32_t symbols;
+        uint32_t hints;
+        uint32_t text; // bytes of name text
+    };
+
+    constexpr char bytecode_magic[4] = {'G', 'L', 'C', 0};
+    constexpr uint32_t bytecode_version = 5;
+
+    // FNV-1a, good enough to key the cache on
+    uint64_t hash_source(std::string_view text);
+
+    std::vector<unsigned char> write_bytecode(const IRBuilder &builder, uint64_t source_hash = 0);
+    // empty if bytes aren't a valid module for this version
+    std::optional<IRBuilder> read_bytecode(std::string_view bytes, uint64_t *source_hash = nullptr);
+
+    struct MappedBytecode {
+        IRBuilder builder; // names, symbols and hints, ir and constants stay empty
+        std::shared_ptr<const Program> program;
+    };
+    // read_bytecode without copying the code: the program points into source and keeps
+    // it alive. only copies if the code happens to be misaligned in memory
+    std::optional<MappedBytecode> map_bytecode(const Source &source, uint64_t *source_hash = nullptr);
+
+    // where the cached module for a source with this hash lives: $GLASS_CACHE_DIR,
+    // else $XDG_CACHE_HOME/glass, else ~/.cache/glass. empty if none of them is set
+    std::optional<std::string> cache_path(uint64_t source_hash);
+    // writes to a temporary file first so concurrent runs never see half a module
+    bool write_file_atomic(const std::string &path, const std::vector<unsigned char> &bytes);
+}
+
+#endif//__BYTECODE_HPP__
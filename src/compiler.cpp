@@ -1,38 +1,121 @@
 #include <iostream>
-#include <sstream>
 #include <fstream>
-#include "parser.hpp"
-#include "backend.hpp"
+#include <cstring>
+#include "glass.hpp"
+#include "bytecode.hpp"
+#ifdef GLASS_X86_64
+#include "aot.hpp"
+#endif
+#ifdef GLASS_PROFILE
+#include "profile.hpp"
+#endif
 
-int main(){
+int main(int argc, char *argv[]){
     using namespace glass;
 
-    std::ostringstream file_buffer = {};
+    const char *filename = "main.gls";
+    const char *output = NULL;
+    std::vector<std::string> entries = {}; // -e, what the output has to keep
+#ifdef GLASS_PROFILE
+    const char *profile_path = NULL;
+#endif
+    for (int argi = 1; argi < argc; argi++){
+        if (!strcmp(argv[argi], "-o") && argi + 1 < argc)
+            output = argv[++argi];
+        else if (!strcmp(argv[argi], "-e") && argi + 1 < argc)
+            entries.push_back(argv[++argi]);
+#ifdef GLASS_PROFILE
+        else if (!strncmp(argv[argi], "--profile", 9))
+            profile_path = argv[argi][9] == '=' ? argv[argi] + 10 : "glass-profile.json";
+#endif
+        else
+            filename = argv[argi];
+    }
+
+    auto source = Source::map(filename);
+    if (!source){
+        std::cerr << "glassc: failed to open file " << filename << ": ";
+        perror(NULL);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t hash = hash_source(source->text());
+    auto compiled = compile(*source, filename);
+    if (!compiled){
+        std::cerr << "glassc: " << compiled.error().message << std::endl;
+        return EXIT_FAILURE;
+    }
+    IRBuilder &builder = *compiled;
+    // functions nothing can reach from main (or the -e functions) are left out
+    if (entries.empty() && builder.entry("main") >= 0)
+        entries.push_back("main");
+    if (!entries.empty() && !builder.shake(entries)){
+        std::cerr << "glassc: " << filename << " doesn't define every function given with -e" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    {
-        std::ifstream input("main.gls");
-        if (!input){
-            perror("failed to open file main.gls");
+    std::string_view out_name = output ? output : "";
+    if (out_name.size() > 4 && out_name.substr(out_name.size() - 4) == ".glc"){
+        // bytecode module for glass to run without compiling
+        if (!write_file_atomic(output, write_bytecode(builder, hash))){
+            std::cerr << "glassc: failed to write " << output << ": ";
+            perror(NULL);
             return EXIT_FAILURE;
         }
-        char buffer[1024];
-        while (!input.eof()){
-            file_buffer.write(buffer, input.read(buffer, sizeof(buffer)).gcount());
+        return EXIT_SUCCESS;
+    }
+
+    if (output){
+#ifdef GLASS_X86_64
+        auto object = compile_object(builder);
+        if (!object){
+            std::cerr << "glassc: " << filename << " can't be lowered to machine code" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::ofstream out(output, std::ios::binary);
+        if (!out.write((const char *)object->data(), object->size())){
+            std::cerr << "glassc: failed to write " << output << ": ";
+            perror(NULL);
+            return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
+#else
+        std::cerr << "glassc: native code generation is only supported on x86-64" << std::endl;
+        return EXIT_FAILURE;
+#endif
     }
 
-    Lexer lexer(file_buffer.str());
-    Parser parser(std::move(lexer));
-    IRBuilder builder = {};
-    while (parser.next_node()) {}
-    for (auto &node : parser.nodes){
-        builder.feed(node);
-    }
-    builder.finalize();
+    int entry = builder.entry("main");
+    if (entry < 0){
+        std::cerr << "glassc: " << filename << " has no main function" << std::endl;
+        return EXIT_FAILURE;
+    }
     VM vm = {};
-    vm.program = std::move(builder.ir);
-    vm.pc = builder.symbols["main"];
-    while (!vm.should_exit)
-        vm.step();
+    vm.pc = entry;
+    vm.program = Program::make(std::move(builder.ir), std::move(builder.constants));
+#ifdef GLASS_PROFILE
+    std::optional<Profile> profile = {};
+    if (profile_path){
+        profile.emplace(builder, *vm.program);
+        vm.profile = &*profile;
+    }
+#endif
+    bool ok = vm.run();
+#ifdef GLASS_PROFILE
+    if (profile){
+        vm.profile = nullptr;
+        profile->report(std::cerr, filename);
+        std::ofstream json(profile_path);
+        json << "[";
+        profile->write_json(json, filename);
+        json << "]" << std::endl;
+        if (!json)
+            std::cerr << "glassc: failed to write " << profile_path << std::endl;
+    }
+#endif
+    if (!ok){
+        std::cerr << "glassc: " << filename << ": " << trap_message(vm.trap) << std::endl;
+        return EXIT_FAILURE;
+    }
     return vm.registers[0];
 }
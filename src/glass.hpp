@@ -0,0 +1,147 @@
+#ifndef __GLASS_HPP__
+#define __GLASS_HPP__
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "lexer.hpp"
+#include "backend.hpp"
+
+// the embedding API. compile a script once into a Module, then call its functions
+// from as many Contexts as needed, one per thread:
+//
+//   auto module = glass::Module::compile(text, "rules.gls");
+//   if (!module)
+//       log(module.error().message);
+//   glass::Context context(*module);       // per thread, cheap
+//   auto result = context.call("main");    // as often as you like
+//
+// nothing here prints or exits, errors come back as values.
+namespace glass {
+    struct Error {
+        std::string message; // "name:line:col: what" when it's about the source
+        Trap trap = Trap::None; // set when a call trapped
+    };
+
+    // a value or the Error explaining why there isn't one
+    template <typename T>
+    class Result {
+    public:
+        Result(T value) : result(std::move(value)) {}
+        Result(Error error) : failure(std::move(error)) {}
+
+        explicit operator bool() const {
+            return result.has_value();
+        }
+        T &operator*(){
+            return *result;
+        }
+        const T &operator*() const {
+            return *result;
+        }
+        T *operator->(){
+            return &*result;
+        }
+        const T *operator->() const {
+            return &*result;
+        }
+        const Error &error() const {
+            return failure;
+        }
+
+    private:
+        std::optional<T> result = {};
+        Error failure = {};
+    };
+
+    // a diagnostic about source as "name:line:col: message"
+    Error located(const Source &source, const std::string &name, const Diagnostic &diagnostic);
+
+    // lexes, parses, lowers and (unless told not to) optimizes source, with every
+    // diagnostic reported against name
+    Result<IRBuilder> compile(const Source &source, const std::string &name, bool optimize = true);
+
+    // a compiled program. immutable once built, so any number of threads can share one
+    class Module {
+    public:
+        static Result<std::shared_ptr<const Module>> compile(std::string_view source, const std::string &name = "<source>");
+        // a .glc module if the file is one, source otherwise
+        static Result<std::shared_ptr<const Module>> load(const char *filename);
+        static std::shared_ptr<const Module> from(IRBuilder &&builder, const std::string &name);
+        // builder's ir and constants are ignored, program is run instead
+        static std::shared_ptr<const Module> from(IRBuilder &&builder, std::shared_ptr<const Program> program,
+                                                  const std::string &name);
+
+        const std::string &name() const {
+            return module_name;
+        }
+        // the entry point of a function, empty if the module doesn't define it
+        std::optional<uint32_t> find(std::string_view function) const;
+
+    private:
+        friend class Context;
+        Module() = default;
+
+        std::string module_name = {};
+        std::shared_ptr<const Program> program = {}; // every Context runs this very copy
+        Names names = {};
+        std::vector<int> symbols = {}; // by name id, as in IRBuilder
+    };
+
+    // a VM running one Module. not thread-safe itself, give every thread its own
+    class Context {
+    public:
+        explicit Context(std::shared_ptr<const Module> module);
+        // takes its stack from pool, which is much cheaper than mapping a new one
+        Context(std::shared_ptr<const Module> module, VMPool &pool);
+
+        Result<uintptr_t> call(std::string_view function);
+        Result<uintptr_t> call(uint32_t entry);
+        // finishes a call that ran out of vm().fuel or went past vm().deadline, once
+        // they've been raised. call() again instead to give up on it
+        Result<uintptr_t> resume();
+
+        const Module &module() const {
+            return *mod;
+        }
+        // for setting up a jit, a profile and the like
+        VM &vm(){
+            return machine;
+        }
+
+    private:
+        std::shared_ptr<const Module> mod;
+        VM machine;
+
+        void load();
+        Result<uintptr_t> finish(bool ok);
+    };
+
+    // a program built up a line at a time, for the REPL. functions stay defined from
+    // one line to the next and each line only compiles and links what it adds, so a
+    // line costs the same however long the session has been going. defining a
+    // function again shadows it for later lines, code already calling it keeps the
+    // old one
+    class Session {
+    public:
+        // compiles line and runs its top-level code, a bare expression is returned.
+        // a line that defines main runs main instead. empty if there was nothing to
+        // run. a line that doesn't compile leaves no trace
+        Result<std::optional<uintptr_t>> feed(std::string_view line);
+
+        const IRBuilder &builder() const {
+            return program;
+        }
+        // for setting up a jit and the like. its program is only good until the next feed()
+        VM &vm(){
+            return machine;
+        }
+
+    private:
+        IRBuilder program = {};
+        VM machine = {};
+    };
+}
+
+#endif//__GLASS_HPP__
@@ -1,9 +1,24 @@
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <optional>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
 #include "parser.hpp"
 #include "backend.hpp"
+#include "bytecode.hpp"
+#include "glass.hpp"
+#include "sampler.hpp"
+#include "lazy.hpp"
+#ifdef GLASS_JIT
+#include "jit.hpp"
+#endif
+#ifdef GLASS_PROFILE
+#include "profile.hpp"
+#endif
 #ifdef GLASS_USE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -22,104 +37,475 @@ char *glass_readline(const char *prompt){
 }
 #endif
 
-std::optional<uintptr_t> run_file(glass::VM &vm, const char *filename){
+bool use_cache = true;
+bool lazy = false; // set by -L
+#ifdef GLASS_PROFILE
+const char *profile_path = nullptr; // set by --profile, where the JSON goes
+#endif
+const char *samples_path = nullptr; // set by --sample, where the folded stacks go
+unsigned sample_hz = 1000;
+uint64_t fuel = glass::VM::unlimited; // --fuel, instructions each file may run
+long timeout_ms = 0;                  // --timeout, 0 for none
+
+// what running a file leaves behind for --profile and --sample
+struct Report {
+    std::string profile = {};
+    std::string samples = {};
+};
+
+std::optional<glass::Source> open_file(const char *filename, std::ostream &err = std::cerr){
+    auto source = glass::Source::map(filename);
+    if (!source)
+        err << "glass: failed to open file " << filename << ": " << strerror(errno) << std::endl;
+    return source;
+}
+
+std::optional<glass::IRBuilder> compile_source(const glass::Source &source, const char *filename, std::ostream &err = std::cerr,
+                                               bool optimize = true){
+    auto builder = glass::compile(source, filename, optimize);
+    if (!builder){
+        err << "glass: " << builder.error().message << std::endl;
+        return {};
+    }
+    return std::move(*builder);
+}
+
+// a program ready to run. builder has its names, symbols and hints, the code and
+// constants are in program
+struct Loaded {
+    glass::IRBuilder builder;
+    std::shared_ptr<const glass::Program> program;
+};
+
+// .glc modules (and cached ones) run straight out of their mapping. sources are
+// looked up in the compile cache by content hash first, and put there after compiling
+std::optional<Loaded> load_file(const char *filename, std::ostream &err = std::cerr){
     using namespace glass;
-    std::ostringstream file_buffer = {};
+    auto source = open_file(filename, err);
+    if (!source)
+        return {};
 
-    {
-        std::ifstream input(filename);
-        if (!input){
-            std::cerr << "glass: failed to open file " << filename << ": ";
-            perror(NULL);
+    std::string_view name = filename;
+    if (name.size() > 4 && name.substr(name.size() - 4) == ".glc"){
+        auto mapped = map_bytecode(*source);
+        if (!mapped){
+            err << "glass: " << filename << " is not a module this version of glass can run" << std::endl;
             return {};
         }
-        char buffer[1024];
-        while (!input.eof()){
-            file_buffer.write(buffer, input.read(buffer, sizeof(buffer)).gcount());
+        return Loaded { std::move(mapped->builder), std::move(mapped->program) };
+    }
+
+    uint64_t hash = hash_source(source->text());
+    auto path = use_cache ? cache_path(hash) : std::nullopt;
+    if (path){
+        if (auto cached = Source::map(path->c_str())){
+            uint64_t cached_hash = 0;
+            auto mapped = map_bytecode(*cached, &cached_hash);
+            if (mapped && cached_hash == hash)
+                return Loaded { std::move(mapped->builder), std::move(mapped->program) };
         }
     }
 
-    Parser parser(Lexer(file_buffer.str()));
-    IRBuilder builder = {};
-    while (parser.next_node()) {}
-    for (auto &node : parser.nodes){
-        builder.feed(node);
+    auto builder = compile_source(*source, filename, err);
+    if (!builder)
+        return {};
+    // only main runs, so only what it reaches is kept (and cached)
+    if (builder->entry("main") >= 0)
+        builder->shake({"main"});
+    if (path)
+        write_file_atomic(*path, write_bytecode(*builder, hash)); // a cache we can't write to just stays cold
+    auto program = Program::make(std::move(builder->ir), std::move(builder->constants));
+    return Loaded { std::move(*builder), std::move(program) };
+}
+
+// counts adjacent opcode pairs before the peephole pass, most frequent first,
+// to see which superinstructions are worth adding
+bool dump_pairs(const char *filename){
+    using namespace glass;
+    auto source = open_file(filename);
+    if (!source)
+        return false;
+    auto compiled = compile_source(*source, filename, std::cerr, false);
+    if (!compiled)
+        return false;
+    const IRBuilder &builder = *compiled;
+    std::map<std::pair<InstructionType, InstructionType>, size_t> counts = {};
+    for (size_t pc = 1; pc < builder.ir.size(); pc++)
+        counts[{builder.ir[pc - 1].type, builder.ir[pc].type}]++;
+    std::vector<std::pair<size_t, std::pair<InstructionType, InstructionType>>> sorted = {};
+    for (const auto &[pair, count] : counts)
+        sorted.push_back({count, pair});
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b){
+        return a.first > b.first;
+    });
+    std::cout << filename << ": " << builder.ir.size() << " instructions" << std::endl;
+    for (const auto &[count, pair] : sorted)
+        std::cout << count << "\t" << instruction_name(pair.first) << " " << instruction_name(pair.second) << std::endl;
+    return true;
+}
+
+std::optional<int> find_main(const glass::IRBuilder &builder, const char *filename, std::ostream &err){
+    int entry = builder.entry("main");
+    if (entry < 0){
+        err << "glass: " << filename << " has no main function" << std::endl;
+        return {};
+    }
+    return entry;
+}
+
+void set_limits(glass::VM &vm){
+    vm.fuel = fuel;
+    vm.deadline = timeout_ms ? glass::VM::clock::now() + std::chrono::milliseconds(timeout_ms) : glass::VM::clock::time_point::max();
+}
+
+// -L: only what main ends up calling gets compiled, each function on its first call
+std::optional<uintptr_t> run_lazy(glass::VM &vm, const char *filename, std::ostream &err){
+    using namespace glass;
+    auto source = open_file(filename, err);
+    if (!source)
+        return {};
+    Lazy program(*source);
+    if (!program.scan()){
+        err << "glass: " << located(*source, filename, *program.failure).message << std::endl;
+        return {};
+    }
+    auto entry = find_main(program.builder(), filename, err);
+    if (!entry)
+        return {};
+#ifdef GLASS_JIT
+    if (vm.jit)
+        vm.jit->reset();
+#endif
+    vm.program = program.program();
+    vm.lazy = &program;
+    vm.reset();
+    vm.pc = *entry;
+    set_limits(vm);
+    bool ok = vm.run();
+    // both point into program
+    vm.lazy = nullptr;
+    vm.program = nullptr;
+    if (!ok && vm.trap == Trap::CompileError)
+        err << "glass: " << located(*source, filename, *program.failure).message << std::endl;
+    else if (!ok)
+        err << "glass: " << filename << ": " << trap_message(vm.trap) << std::endl;
+    if (!ok)
+        return {};
+    return vm.registers[0];
+}
+
+// with --profile the report goes to err, the JSON and any samples end up in report
+std::optional<uintptr_t> run_file(glass::VM &vm, const char *filename, std::ostream &err = std::cerr,
+                                  Report *report = nullptr){
+    std::string_view name = filename;
+    bool module = name.size() > 4 && name.substr(name.size() - 4) == ".glc";
+#ifdef GLASS_PROFILE
+    bool profiling = profile_path;
+#else
+    bool profiling = false;
+#endif
+    // the profilers want every function named up front
+    if (lazy && !module && !profiling && !samples_path)
+        return run_lazy(vm, filename, err);
+
+    auto loaded = load_file(filename, err);
+    if (!loaded)
+        return {};
+    auto entry = find_main(loaded->builder, filename, err);
+    if (!entry)
+        return {};
+#ifdef GLASS_JIT
+    if (vm.jit)
+        vm.jit->reset();
+#endif
+#ifdef GLASS_PROFILE
+    std::optional<glass::Profile> profile = {};
+    if (profile_path){
+        profile.emplace(loaded->builder, *loaded->program);
+        vm.profile = &*profile;
+    }
+#endif
+    std::optional<glass::Samples> samples = {};
+    std::vector<std::pair<uint32_t, std::string>> functions = {};
+    if (samples_path && report){
+        samples.emplace();
+        functions = loaded->builder.functions();
+        vm.samples = &*samples;
+    }
+    vm.program = std::move(loaded->program);
+    vm.reset(); // nothing from the previous file stays on the stack
+    vm.pc = *entry;
+    set_limits(vm);
+    bool ok = vm.run();
+#ifdef GLASS_PROFILE
+    if (profile){
+        vm.profile = nullptr;
+        profile->report(err, filename);
+        if (report){
+            std::ostringstream json;
+            profile->write_json(json, filename);
+            report->profile = json.str();
+        }
+    }
+#endif
+    if (samples){
+        vm.samples = nullptr;
+        std::ostringstream folded;
+        samples->write_folded(folded, functions, filename);
+        report->samples = folded.str();
+    }
+    if (!ok){
+        err << "glass: " << filename << ": " << trap_message(vm.trap) << std::endl;
+        return {};
     }
-    builder.finalize();
-    vm.program = std::move(builder.ir);
-    vm.pc = builder.symbols.at("main");
-    while (!vm.should_exit)
-        vm.step();
     return vm.registers[0];
 }
 
+#ifdef GLASS_JIT
+// runs the file once interpreted and once with every function compiled on its first call
+std::optional<uintptr_t> check_file(const char *filename, std::ostream &err = std::cerr){
+    using namespace glass;
+    auto loaded = load_file(filename, err);
+    if (!loaded)
+        return {};
+    auto entry = find_main(loaded->builder, filename, err);
+    if (!entry)
+        return {};
+    JIT jit(1);
+    VM interpreted = {}, native = {};
+    native.jit = &jit;
+    auto program = loaded->program;
+    for (VM *vm : {&interpreted, &native}){
+        vm->program = program;
+        if (!vm->call(*entry)){
+            err << "glass: " << filename << ": " << trap_message(vm->trap)
+                << (vm == &native ? " with the jit" : "") << std::endl;
+            return {};
+        }
+    }
+    if (interpreted.registers[0] != native.registers[0]){
+        err << "glass: " << filename << ": interpreter returned " << interpreted.registers[0]
+            << " but the jit returned " << native.registers[0] << std::endl;
+        return {};
+    }
+    return interpreted.registers[0];
+}
+#endif
+
+// a file to run and the flags that were given before it
+struct Job {
+    const char *filename;
+    bool jit = false;
+    bool check = false;
+};
+
+// runs every job on its own worker VM (and jit), `threads` at a time. results and
+// diagnostics come back in argument order, so the outcome matches running them one by one
+std::vector<std::optional<uintptr_t>> run_jobs(const std::vector<Job> &jobs, unsigned threads,
+                                               std::vector<Report> &reports){
+    std::vector<std::optional<uintptr_t>> results(jobs.size());
+    reports.resize(jobs.size());
+    std::vector<std::string> messages(jobs.size());
+    std::atomic<size_t> next = 0;
+    auto worker = [&]{
+        glass::VM vm = {};
+#ifdef GLASS_JIT
+        glass::JIT jit;
+#endif
+        for (size_t n; (n = next++) < jobs.size();){
+            std::ostringstream err;
+#ifdef GLASS_JIT
+            vm.jit = jobs[n].jit ? &jit : nullptr;
+#ifdef GLASS_PROFILE
+            if (profile_path)
+                vm.jit = nullptr; // native code isn't counted
+#endif
+            results[n] = jobs[n].check ? check_file(jobs[n].filename, err) : run_file(vm, jobs[n].filename, err, &reports[n]);
+#else
+            results[n] = run_file(vm, jobs[n].filename, err, &reports[n]);
+#endif
+            if (threads == 1)
+                std::cerr << err.str(); // already in order, no need to hold on to it
+            else
+                messages[n] = err.str();
+        }
+    };
+
+    threads = std::max(1u, std::min<unsigned>(threads, jobs.size()));
+    std::vector<std::thread> pool = {};
+    for (unsigned t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (std::thread &thread : pool)
+        thread.join();
+
+    for (const std::string &message : messages)
+        std::cerr << message;
+    return results;
+}
+
 int main(int argc, char *argv[]){
     if (argc < 2){
-        std::cerr << "usage: glass [-i] FILES..." << std::endl;
+        std::cerr << "usage: glass [-i] [-p] [-n] [-L] [-j N] [-J] [-c] FILES..." << std::endl;
         std::cerr << "\t-i\tenables interactive mode (REPL)" << std::endl;
+        std::cerr << "\t-p\tprints opcode pair counts instead of running files" << std::endl;
+        std::cerr << "\t-n\tdoesn't use the compile cache" << std::endl;
+        std::cerr << "\t-L\tcompiles each function on its first call, not with --profile or --sample" << std::endl;
+        std::cerr << "\t-j N\truns up to N files at once, 0 for one per core" << std::endl;
+#ifdef GLASS_JIT
+        std::cerr << "\t-J\tcompiles hot functions to native code" << std::endl;
+        std::cerr << "\t-c\truns files with and without the jit and compares the results" << std::endl;
+#endif
+#ifdef GLASS_PROFILE
+        std::cerr << "\t--profile[=FILE]\tcounts and times everything, prints a report and writes JSON (glass-profile.json)" << std::endl;
+#endif
+        std::cerr << "\t--sample[=FILE]\tsamples call stacks and writes them folded for flamegraphs (glass.folded)" << std::endl;
+        std::cerr << "\t--sample-hz=N\tsamples N times per second of cpu time, 1000 by default" << std::endl;
+        std::cerr << "\t--fuel=N\tstops each file after about N instructions" << std::endl;
+        std::cerr << "\t--timeout=MS\tstops each file after about MS milliseconds" << std::endl;
         return EXIT_FAILURE;
     }
 
     using namespace glass;
-    VM vm = {};
+#ifdef GLASS_JIT
+    JIT jit; // the REPL's, every file gets its own
+    bool use_jit = false;
+    bool check = false;
+#endif
 
     bool i = false;
+    bool pairs = false;
     bool error = false;
     int code = 0;
+    unsigned threads = 1;
+    std::vector<Job> jobs = {};
 
     for (int argi = 1; argi < argc; argi++){
         char *arg = argv[argi];
         if (*arg == '-'){
+#ifdef GLASS_PROFILE
+            if (!strncmp(arg, "--profile", 9)){
+                profile_path = arg[9] == '=' ? arg + 10 : "glass-profile.json";
+                continue;
+            }
+#endif
+            if (!strncmp(arg, "--sample-hz=", 12)){
+                sample_hz = std::max(1, atoi(arg + 12));
+                continue;
+            }
+            if (!strncmp(arg, "--fuel=", 7)){
+                fuel = strtoull(arg + 7, nullptr, 10);
+                continue;
+            }
+            if (!strncmp(arg, "--timeout=", 10)){
+                timeout_ms = std::max(0l, atol(arg + 10));
+                continue;
+            }
+            if (!strncmp(arg, "--sample", 8)){
+                samples_path = arg[8] == '=' ? arg + 9 : "glass.folded";
+                continue;
+            }
             if (arg[1] == 'i')
                 i = true; // enable interactive mode
+            else if (arg[1] == 'p')
+                pairs = true;
+            else if (arg[1] == 'n')
+                use_cache = false;
+            else if (arg[1] == 'L')
+                lazy = true;
+            else if (arg[1] == 'j'){
+                const char *count = arg[2] ? arg + 2 : argi + 1 < argc ? argv[++argi] : "1";
+                threads = atoi(count);
+                if (threads == 0)
+                    threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+#ifdef GLASS_JIT
+            else if (arg[1] == 'J')
+                use_jit = true;
+            else if (arg[1] == 'c')
+                check = true;
+#endif
+        } else if (pairs){
+            error |= !dump_pairs(arg);
         } else {
-            auto res = run_file(vm, arg);
-            if (res.has_value())
-                code = res.value();
-            else
-                error = true;
+#ifdef GLASS_JIT
+            jobs.push_back(Job { .filename = arg, .jit = use_jit, .check = check });
+#else
+            jobs.push_back(Job { .filename = arg });
+#endif
+        }
+    }
+
+    if (samples_path && !jobs.empty() && !start_sampling(sample_hz)){
+        std::cerr << "glass: failed to start the sampling timer: " << strerror(errno) << std::endl;
+        samples_path = nullptr;
+        error = true;
+    }
+    std::vector<Report> reports = {};
+    for (const auto &res : run_jobs(jobs, threads, reports)){
+        if (res.has_value())
+            code = res.value();
+        else
+            error = true;
+    }
+    if (samples_path && !jobs.empty()){
+        stop_sampling();
+        std::ofstream out(samples_path);
+        for (const Report &report : reports)
+            out << report.samples;
+        if (!out){
+            std::cerr << "glass: failed to write " << samples_path << std::endl;
+            error = true;
         }
     }
+#ifdef GLASS_PROFILE
+    if (profile_path && !jobs.empty()){
+        std::ofstream out(profile_path);
+        out << "[";
+        bool first = true;
+        for (const Report &report : reports){
+            if (report.profile.empty())
+                continue;
+            out << (first ? "" : ",\n ") << report.profile;
+            first = false;
+        }
+        out << "]" << std::endl;
+        if (!out){
+            std::cerr << "glass: failed to write " << profile_path << std::endl;
+            error = true;
+        }
+    }
+#endif
 
     if (!i)
         return error ? EXIT_FAILURE : code;
     init_readline();
 
     std::cout << "Glass v0.0.1 REPL" << std::endl;
+    Session session;
+#ifdef GLASS_JIT
+    session.vm().jit = use_jit ? &jit : nullptr;
+#endif
     while (i){
         char *line = glass_readline("> ");
         if (!line) break;
-        Lexer lexer(line);
-        if (lexer.lookahead() == TokenType::EndOfFile) {
+        if (Lexer(line).lookahead().type == TokenType::EndOfFile) {
             free(line);
             continue;
         }
-        if (lexer.lookahead() == TokenType::Identifier || lexer.lookahead() == TokenType::IntLiteral || lexer.lookahead() == TokenType::Minus){
-            lexer = Lexer("return " + std::string(line) + ";");
-        }
 #ifdef GLASS_USE_READLINE
         add_history(line);
 #endif
+#ifdef GLASS_JIT
+        if (use_jit)
+            jit.reset();
+#endif
+        auto result = session.feed(line);
         free(line);
-        Parser parser(std::move(lexer));
-        IRBuilder builder = {};
-        while (parser.next_node()) {}
-        for (auto &node : parser.nodes){
-            builder.feed(node);
-        }
-        vm.should_exit = false;
-        vm.program = std::move(builder.ir);
-        if (builder.symbols.find("main") != builder.symbols.cend())
-            vm.pc = builder.symbols.at("main");
-        else {
-            vm.program.push_back(Instruction {
-                .type = InstructionType::Halt
-            });
-            vm.pc = 0;
-        }
-        while (!vm.should_exit)
-            vm.step();
-        std::cout << "$ " << vm.registers[0] << std::endl;
+        if (!result)
+            std::cerr << "glass: " << result.error().message << std::endl;
+        else if (*result)
+            std::cout << "$ " << **result << std::endl;
     }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,78 @@
+#include "jit.hpp"
+#include "backend.hpp"
+#include "x86.hpp"
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace glass {
+    // Call out of native code goes back through the VM, which picks native or
+    // interpreted code for the callee and keeps the stack frames identical
+    static void jit_call(VM *vm, uint32_t target){
+        vm->call(target);
+    }
+
+    JIT::JIT(uint32_t threshold, size_t capacity) : threshold(threshold), capacity(capacity) {
+        void *mem = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED){
+            buffer = nullptr;
+            this->capacity = 0;
+        } else {
+            buffer = (unsigned char *)mem;
+        }
+    }
+
+    JIT::~JIT(){
+        if (buffer)
+            munmap(buffer, capacity);
+    }
+
+    JIT::Function JIT::compile(const VM &vm, int entry){
+        X86Assembler e(X86Assembler::Layout {
+            .regs = (int32_t)((const char *)&vm.registers - (const char *)&vm),
+            .stack = (int32_t)((const char *)&vm.stack - (const char *)&vm),
+            .sp = (int32_t)((const char *)&vm.sp - (const char *)&vm),
+            .base = (int32_t)((const char *)&vm.base - (const char *)&vm),
+        });
+        e.prologue();
+
+        // no branches yet, so a function ends at its first Return (or LoadImmReturn, TailCall)
+        for (size_t pc = entry;; pc++){
+            if (pc >= vm.program->size)
+                return nullptr;
+            const Instruction &ins = (*vm.program)[pc];
+            if (ins.type == InstructionType::LoadImmReturn)
+                e.lower(Instruction { .type = InstructionType::LoadImm, .dst = ins.dst, .imm = ins.imm }, vm.program->constants);
+            if (ins.type == InstructionType::Return || ins.type == InstructionType::LoadImmReturn){
+                e.epilogue();
+                break;
+            }
+            if (ins.type == InstructionType::TailCall){
+                // left to the VM, which runs the callee in this same frame once we've
+                // returned, so tail recursion doesn't grow the native stack or the VM's
+                e.store_imm((int32_t)((const char *)&vm.tail_call - (const char *)&vm), ins.imm);
+                e.epilogue();
+                break;
+            }
+            if (ins.type == InstructionType::Call)
+                e.call_abs((uintptr_t)&jit_call, ins.imm);
+            else if (!e.lower(ins, vm.program->constants))
+                return nullptr;
+        }
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = (used + 15) & ~(size_t)15;
+        if (!buffer || start + e.code.size() > capacity)
+            return nullptr;
+
+        // only the pages being written are ever writable
+        size_t first = start & ~(page - 1);
+        size_t last = (start + e.code.size() + page - 1) & ~(page - 1);
+        if (mprotect(buffer + first, last - first, PROT_READ | PROT_WRITE) != 0)
+            return nullptr;
+        memcpy(buffer + start, e.code.data(), e.code.size());
+        mprotect(buffer + first, last - first, PROT_READ | PROT_EXEC);
+        used = start + e.code.size();
+        return (Function)(buffer + start);
+    }
+}
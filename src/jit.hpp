@@ -0,0 +1,62 @@
+#ifndef __JIT_HPP__
+#define __JIT_HPP__
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace glass {
+    class VM;
+
+    // baseline x86-64 jit. every Call bumps a counter for its target and once a
+    // function passes the threshold it gets compiled to native code. compiled code
+    // works directly on the VM's registers and stack, so native and interpreted
+    // functions can call each other freely.
+    class JIT {
+    public:
+        using Function = void (*)(VM *vm);
+
+        uint32_t threshold;
+
+        explicit JIT(uint32_t threshold = 1000, size_t capacity = 1 << 20);
+        ~JIT();
+
+        JIT(const JIT &) = delete;
+        JIT &operator=(const JIT &) = delete;
+
+        // native code for the function at entry, or nullptr if it should stay interpreted
+        Function hot(const VM &vm, int entry){
+            if ((size_t)entry >= functions.size()){
+                functions.resize(entry + 1, nullptr);
+                counts.resize(entry + 1, 0);
+            }
+            if (functions[entry])
+                return functions[entry];
+            if (counts[entry] == UINT32_MAX || ++counts[entry] < threshold)
+                return nullptr;
+            functions[entry] = compile(vm, entry);
+            if (!functions[entry])
+                counts[entry] = UINT32_MAX; // don't try again
+            return functions[entry];
+        }
+
+        // compiles the function starting at entry, nullptr if it can't be lowered
+        Function compile(const VM &vm, int entry);
+
+        // forgets everything compiled so far, needed whenever the VM gets a new program
+        void reset(){
+            counts.clear();
+            functions.clear();
+            used = 0;
+        }
+
+    private:
+        unsigned char *buffer;
+        size_t capacity;
+        size_t used = 0;
+
+        std::vector<uint32_t> counts = {};
+        std::vector<Function> functions = {};
+    };
+}
+
+#endif//__JIT_HPP__
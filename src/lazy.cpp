@@ -0,0 +1,106 @@
+#include "lazy.hpp"
+#include "parser.hpp"
+
+namespace glass {
+    bool Lazy::scan(){
+        std::string_view text = source.text();
+        Lexer lex(source);
+        auto expect = [&](TokenType type, const char *what){
+            Token tok = lex.next();
+            if (tok != type)
+                return fail(tok.pos, std::string("expected ") + what + ", got type " + std::to_string((int)tok.type));
+            return true;
+        };
+
+        for (Token tok; (tok = lex.next()) != TokenType::EndOfFile;){
+            if (tok == TokenType::ReturnKeyword){
+                // top-level code, which never runs when main is where a run starts
+                int depth = 0;
+                do {
+                    tok = lex.next();
+                    if (tok == TokenType::EndOfFile)
+                        return fail(tok.pos, "expected semicolon, got type " + std::to_string((int)tok.type));
+                    depth += (tok == TokenType::OpenCurly) - (tok == TokenType::CloseCurly);
+                } while (tok != TokenType::Semicolon || depth > 0);
+                continue;
+            }
+            if (tok != TokenType::FuncKeyword)
+                return fail(tok.pos, "expected func or return, got type " + std::to_string((int)tok.type));
+            Token name = lex.lookahead();
+            if (!expect(TokenType::Identifier, "identifier")
+                || !expect(TokenType::OpenParentheses, "open parentheses to start parameter list")
+                || !expect(TokenType::CloseParentheses, "close parentheses, functions don't take parameters yet"))
+                return false;
+            size_t open = lex.lookahead().pos;
+            if (!expect(TokenType::OpenCurly, "open curly brace to start block"))
+                return false;
+
+            // braces are matched on the raw bytes, the language has nothing (strings,
+            // comments) a brace could hide in
+            size_t end = open + 1;
+            for (int depth = 1; end < text.size(); end++){
+                depth += (text[end] == '{') - (text[end] == '}');
+                if (!depth)
+                    break;
+            }
+            if (end == text.size())
+                return fail(end, "expected close curly brace to end block");
+            end++;
+
+            // like feeding it all, a later definition replaces an earlier one
+            // only function names are interned so far, so a name's id is its stub
+            uint32_t fn = unit.names.intern(name.value, name.hash);
+            Body body = { .begin = tok.pos, .end = end };
+            if (fn == bodies.size()){
+                bodies.push_back(std::move(body));
+                unit.symbols.push_back(fn);
+            } else {
+                bodies[fn] = std::move(body);
+            }
+            lex = Lexer(source, end, text.size());
+        }
+
+        // the stubs come first, so a Call's target tells a stub from real code
+        for (size_t i = 0; i < bodies.size(); i++)
+            unit.ir.push_back(Instruction { .type = InstructionType::Compile, .imm = (uint32_t)i });
+        return true;
+    }
+
+    int Lazy::compile(VM &vm, uint32_t function){
+        if (function >= bodies.size())
+            return -1;
+        Body &body = bodies[function];
+        if (body.entry >= 0)
+            return body.entry;
+
+        Parser parser(Lexer(source, body.begin, body.end));
+        parser.next_node();
+        if (parser.failure){
+            fail(parser.failure->pos, parser.failure->message);
+            return -1;
+        }
+        IRBuilder::Mark mark = unit.mark();
+        unit.feed(parser.ast);
+        if (!unit.finalize()){
+            fail(unit.errors[mark.errors].pos, unit.errors[mark.errors].message);
+            unit.rewind(mark);
+            return -1;
+        }
+        unit.optimize(mark.ir);
+        // the Symbol went into hints, so the body starts right at the mark
+        body.entry = mark.ir;
+
+        for (size_t pc = mark.ir; pc < unit.ir.size(); pc++){
+            const Instruction &ins = unit.ir[pc];
+            if ((ins.type == InstructionType::Call || ins.type == InstructionType::TailCall) && ins.imm < bodies.size() && bodies[ins.imm].entry < 0)
+                bodies[ins.imm].callers.push_back(pc);
+        }
+        for (uint32_t pc : body.callers)
+            unit.ir[pc].imm = body.entry;
+        body.callers = {};
+        compiled_count++;
+
+        vm.program = program();
+        return body.entry;
+    }
+}
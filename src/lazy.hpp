@@ -0,0 +1,70 @@
+#ifndef __LAZY_HPP__
+#define __LAZY_HPP__
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "lexer.hpp"
+#include "backend.hpp"
+
+namespace glass {
+    // compiles a program a function at a time, the first time each one is called.
+    // scan() only finds where each function's body starts and ends and gives it a
+    // stub, a single Compile, for calls to go to. so starting up costs one pass over
+    // the bytes, however much of the file never runs. compile() moves a stub's
+    // callers over to the real code as it goes.
+    //
+    // a function's syntax and link errors only come up when it's first called, as
+    // Trap::CompileError. top-level returns are skipped, main is what runs. the
+    // program grows as it runs, so one Lazy serves one VM at a time
+    class Lazy {
+    public:
+        explicit Lazy(Source source) : source(std::move(source)) {}
+        Lazy(const Lazy &) = delete;
+        Lazy &operator=(const Lazy &) = delete;
+
+        // the first thing that went wrong, in scan() or in a compile()
+        std::optional<Diagnostic> failure = {};
+
+        // false if the file doesn't split into functions
+        bool scan();
+        // compiles function (a stub's imm) unless it already is and points vm at the
+        // grown program. its entry point, -1 if it doesn't compile
+        int compile(VM &vm, uint32_t function);
+
+        // what vm.program has to be to run it, good until the next compile()
+        std::shared_ptr<const Program> program() const {
+            return Program::view(unit.ir.data(), unit.ir.size(), unit.constants.data(), unit.constants.size(), nullptr);
+        }
+        // symbols lead to the stubs until a function is compiled
+        const IRBuilder &builder() const {
+            return unit;
+        }
+        size_t functions() const {
+            return bodies.size();
+        }
+        size_t compiled() const {
+            return compiled_count;
+        }
+
+    private:
+        struct Body {
+            size_t begin, end; // from func to the closing brace
+            int entry = -1;
+            std::vector<uint32_t> callers = {}; // Calls still going to the stub
+        };
+
+        Source source;
+        IRBuilder unit = {};
+        std::vector<Body> bodies = {}; // by stub, which is also its index and its name's id
+        size_t compiled_count = 0;
+
+        bool fail(size_t pos, const std::string &message){
+            if (!failure)
+                failure = Diagnostic { .pos = pos, .message = message };
+            return false;
+        }
+    };
+}
+
+#endif//__LAZY_HPP__
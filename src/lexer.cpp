@@ -1,51 +1,209 @@
 #include "lexer.hpp"
-#include <sstream>
-#include <ctype.h>
+#include <cstring>
+#include <iterator>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static const std::vector<std::string> reserved = {
-    "func",
-    "return",
-    "let"
-};
+namespace {
+    using glass::TokenType;
 
-static constexpr const char *symbols = "():;{}=+-/*";
+    enum CharClass : unsigned char {
+        Space  = 1 << 0,
+        Alpha  = 1 << 1,
+        Word   = 1 << 2, // letters, digits, '_' and '$'
+        Symbol = 1 << 3,
+    };
+
+    constexpr const char *symbols = "():;{}=+-/*";
+
+    struct CharTable {
+        unsigned char cls[256] = {};
+        TokenType symbol[256] = {};
+    };
+
+    constexpr CharTable make_char_table(){
+        CharTable t = {};
+        for (int c : {' ', '\t', '\n', '\v', '\f', '\r'})
+            t.cls[c] |= Space;
+        for (int c = 0; c < 256; c++){
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+                t.cls[c] |= Alpha | Word;
+            if ((c >= '0' && c <= '9') || c == '_' || c == '$')
+                t.cls[c] |= Word;
+        }
+        for (int i = 0; symbols[i]; i++){
+            t.cls[(unsigned char)symbols[i]] |= Symbol;
+            t.symbol[(unsigned char)symbols[i]] = (TokenType)(i + (int)TokenType::OpenParentheses);
+        }
+        return t;
+    }
+
+    constexpr CharTable chars = make_char_table();
+
+    // keywords are told apart by length and first letter, so a slot holds at most one
+    struct Keyword {
+        std::string_view text = {};
+        TokenType type = TokenType::Identifier;
+    };
+
+    constexpr std::string_view reserved[] = {
+        "func",
+        "return",
+        "let"
+    };
+
+    constexpr size_t keyword_hash(std::string_view word){
+        return (word.size() + (unsigned char)word[0]) & 7;
+    }
+
+    struct KeywordTable {
+        Keyword slots[8] = {};
+        bool perfect = true;
+    };
+
+    constexpr KeywordTable make_keyword_table(){
+        KeywordTable t = {};
+        for (size_t i = 0; i < std::size(reserved); i++){
+            Keyword &slot = t.slots[keyword_hash(reserved[i])];
+            if (!slot.text.empty())
+                t.perfect = false;
+            slot = Keyword { .text = reserved[i], .type = (TokenType)(i + (int)TokenType::FuncKeyword) };
+        }
+        return t;
+    }
+
+    constexpr KeywordTable keywords = make_keyword_table();
+    static_assert(keywords.perfect, "keyword_hash collides, pick another one");
+}
+
+glass::Source::Source(std::string_view text) : length(text.length()) {
+    char *buf = new char[length + 1];
+    memcpy(buf, text.data(), length);
+    buf[length] = 0;
+    data = std::shared_ptr<const char>(buf, std::default_delete<const char[]>());
+}
+
+auto glass::Source::map(const char *filename) -> std::optional<Source> {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return {};
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return {};
+    }
+    size_t length = st.st_size;
+    if (length == 0){
+        close(fd);
+        return Source(std::string_view());
+    }
+    void *mem = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return {};
+    return Source(std::shared_ptr<const char>((const char *)mem, [length](const char *p){
+        munmap((void *)p, length);
+    }), length);
+}
+
+auto glass::Source::locate(size_t pos) const -> SourceLocation {
+    SourceLocation loc = { .pos = pos, .line = 1, .col = 1 };
+    const char *text = data.get();
+    for (size_t i = 0; i < pos && i < length; i++){
+        if (text[i] == '\n'){
+            loc.line++;
+            loc.col = 1;
+        } else {
+            loc.col++;
+        }
+    }
+    return loc;
+}
 
 auto glass::Lexer::next() -> Token {
     if (lookahead_buf.has_value()){
-        Token tok = lookahead_buf.value();
-        lookahead_buf = {};
+        Token tok = *lookahead_buf;
+        lookahead_buf.reset();
         return tok;
     }
-    while (isspace(peek_eof()))
-        advance();
+    skip_space();
     Token tok;
     tok.pos = pos;
-    if (!peek().has_value())
+    if (pos >= length)
         return tok;
-    char n = advance().value();
-    if (isalnum(n) || n == '_' || n == '$'){
-        tok.value = read_word(n);
-        tok.type = isalpha(n) ? TokenType::Identifier : TokenType::IntLiteral;
-        auto it = std::find(reserved.cbegin(), reserved.cend(), tok.value);
-        if (it != reserved.cend()){
-            tok.type = (TokenType)(it - reserved.cbegin() + (int)TokenType::FuncKeyword);
-        }
-    } else if (const char *symptr = strchr(symbols, n); symptr && *symptr) {
-        tok.value = std::string() + n;
-        tok.type = (TokenType)(symptr - symbols + (int)TokenType::OpenParentheses);
+    unsigned char n = input[pos];
+    unsigned char cls = chars.cls[n];
+    if (cls & Word){
+        size_t end = scan_word(pos + 1);
+        tok.value = input.substr(pos, end - pos);
+        tok.type = (cls & Alpha) ? TokenType::Identifier : TokenType::IntLiteral;
+        const Keyword &kw = keywords.slots[keyword_hash(tok.value)];
+        if (kw.text == tok.value)
+            tok.type = kw.type;
+        else if (tok.type == TokenType::Identifier)
+            tok.hash = glass::hash_name(tok.value);
+        col += end - pos;
+        pos = end;
     } else {
-        tok.value = std::string() + n;
-        tok.type = TokenType::Illegal;
+        tok.value = input.substr(pos, 1);
+        tok.type = (cls & Symbol) ? chars.symbol[n] : TokenType::Illegal;
+        advance();
     }
     return tok;
 }
 
-std::string glass::Lexer::read_word(char init) {
-    std::ostringstream buf = {};
-    buf << init;
-    int ch;
-    while (ch = peek_eof(), isalnum(ch) || ch == '_' || ch == '$')
-        buf << advance().value();
-    return buf.str();
+void glass::Lexer::skip_space(){
+#ifdef __SSE2__
+    const char *data = input.data();
+    while (pos + 16 <= length){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + pos));
+        // ' ' or '\t'..'\r', bytes >= 0x80 compare as negative and fall out
+        __m128i space = _mm_or_si128(
+            _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+            _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('\t' - 1)),
+                          _mm_cmplt_epi8(chunk, _mm_set1_epi8('\r' + 1))));
+        unsigned mask = _mm_movemask_epi8(space);
+        unsigned run = mask == 0xFFFF ? 16 : __builtin_ctz(~mask);
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))) & ((1u << run) - 1);
+        if (newlines){
+            line += __builtin_popcount(newlines);
+            col = run - (31 - __builtin_clz(newlines));
+        } else {
+            col += run;
+        }
+        pos += run;
+        if (run < 16)
+            return;
+    }
+#endif
+    while (pos < length && (chars.cls[(unsigned char)input[pos]] & Space))
+        advance();
 }
 
+size_t glass::Lexer::scan_word(size_t at){
+#ifdef __SSE2__
+    const char *data = input.data();
+    while (at + 16 <= length){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + at));
+        __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+        __m128i extra = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')),
+                                     _mm_cmpeq_epi8(chunk, _mm_set1_epi8('$')));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), extra));
+        if (mask != 0xFFFF)
+            return at + __builtin_ctz(~mask);
+        at += 16;
+    }
+#endif
+    while (at < length && (chars.cls[(unsigned char)input[at]] & Word))
+        at++;
+    return at;
+}
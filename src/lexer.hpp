@@ -1,8 +1,12 @@
 #ifndef __LEXER_HPP__
 #define __LEXER_HPP__
+#include <algorithm>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <stdint.h>
 
 namespace glass {
     struct SourceLocation {
@@ -11,6 +15,12 @@ namespace glass {
         int col;
     };
 
+    // something wrong with a source, pos is the byte offset it's about
+    struct Diagnostic {
+        size_t pos;
+        std::string message;
+    };
+
     enum class TokenType {
         Illegal = -1,
         EndOfFile,
@@ -27,27 +37,71 @@ namespace glass {
         Identifier, IntLiteral
     };
 
+    // source text that tokens point into. the bytes never move once loaded,
+    // so a Source (and any Lexer holding it) can be moved or copied freely.
+    class Source {
+    public:
+        // copies text into an owned buffer
+        explicit Source(std::string_view text);
+
+        // maps a file read-only, empty with errno set on failure
+        static std::optional<Source> map(const char *filename);
+
+        std::string_view text() const {
+            return std::string_view(data.get(), length);
+        }
+
+        // line and column of a byte offset, for error messages
+        SourceLocation locate(size_t pos) const;
+
+        // keeps the text alive for as long as the pointer is around
+        std::shared_ptr<const char> share() const {
+            return data;
+        }
+
+    private:
+        Source(std::shared_ptr<const char> data, size_t length) : data(std::move(data)), length(length) {}
+
+        std::shared_ptr<const char> data;
+        size_t length;
+    };
+
+    // FNV-1a. the lexer works it out once for every identifier, and Names is keyed on it
+    inline uint32_t hash_name(std::string_view name){
+        uint32_t hash = 0x811c9dc5;
+        for (unsigned char c : name)
+            hash = (hash ^ c) * 0x01000193;
+        return hash;
+    }
+
     struct Token {
-        std::string value = {};
+        std::string_view value = {};
         TokenType type = TokenType::EndOfFile;
+        uint32_t hash = 0; // hash_name(value), for identifiers only
 
         size_t pos;
 
-        bool operator==(TokenType other){
+        bool operator==(TokenType other) const {
             return type == other;
         }
-        bool operator!=(TokenType other){
+        bool operator!=(TokenType other) const {
             return type != other;
         }
     };
 
     class Lexer {
     public:
-        explicit Lexer(std::string s) : input(std::move(s)) {
+        explicit Lexer(Source s) : source(std::move(s)), input(source.text()) {
             length = input.length();
         }
+        explicit Lexer(std::string_view s) : Lexer(Source(s)) {}
+        // just the bytes from begin to end, tokens still say where they are in all of it
+        Lexer(Source s, size_t begin, size_t end) : Lexer(std::move(s)) {
+            length = std::min(end, length);
+            pos = std::min(begin, length);
+        }
 
-        Token lookahead(){
+        const Token &lookahead(){
             if (!lookahead_buf.has_value())
                 lookahead_buf = next();
             return *lookahead_buf;
@@ -55,6 +109,11 @@ namespace glass {
 
         Token next();
 
+        // bytes left to lex
+        size_t size() const {
+            return length - pos;
+        }
+
         SourceLocation get_pos(){
             return SourceLocation {
                 .pos = pos,
@@ -63,34 +122,24 @@ namespace glass {
             };
         }
     private:
-        std::string input;
+        Source source;
+        std::string_view input;
         size_t length;
         size_t pos = 0;
         int line = 1, col = 1;
         std::optional<Token> lookahead_buf = {};
 
-        std::string read_word(char init);
-
-        std::optional<char> peek(){
-            if (pos >= length)
-                return {};
-            return input[pos];
-        }
-
-        int peek_eof(){
-            return peek().value_or(EOF);
-        }
+        // both scan 16 bytes at a time where the input allows, the rest byte by byte
+        void skip_space();
+        size_t scan_word(size_t at);
 
-        std::optional<char> advance(){
-            if (pos >= length)
-                return {};
+        void advance(){
             char ch = input[pos++];
             if (ch == '\n'){
                 col = 0;
                 line++;
             }
             col++;
-            return ch;
         }
     };
 
@@ -0,0 +1,156 @@
+#include "glass.hpp"
+#include "parser.hpp"
+#include "bytecode.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace glass {
+    Error located(const Source &source, const std::string &name, const Diagnostic &diagnostic){
+        SourceLocation loc = source.locate(diagnostic.pos);
+        return Error { .message = name + ":" + std::to_string(loc.line) + ":" + std::to_string(loc.col) + ": " + diagnostic.message };
+    }
+
+    Result<IRBuilder> compile(const Source &source, const std::string &name, bool optimize){
+        Parser parser(Lexer{source});
+        while (parser.next_node()) {}
+        if (parser.failure)
+            return located(source, name, *parser.failure);
+        IRBuilder builder = {};
+        builder.feed(parser.ast);
+        if (!builder.finalize())
+            return located(source, name, builder.errors.front());
+        if (optimize)
+            builder.optimize();
+        return builder;
+    }
+
+    std::shared_ptr<const Module> Module::from(IRBuilder &&builder, const std::string &name){
+        auto program = Program::make(std::move(builder.ir), std::move(builder.constants));
+        return from(std::move(builder), std::move(program), name);
+    }
+
+    std::shared_ptr<const Module> Module::from(IRBuilder &&builder, std::shared_ptr<const Program> program,
+                                               const std::string &name){
+        std::shared_ptr<Module> module(new Module());
+        module->module_name = name;
+        module->program = std::move(program);
+        module->names = std::move(builder.names);
+        module->symbols = std::move(builder.symbols);
+        return module;
+    }
+
+    auto Module::compile(std::string_view source, const std::string &name) -> Result<std::shared_ptr<const Module>> {
+        auto builder = glass::compile(Source(source), name);
+        if (!builder)
+            return builder.error();
+        return from(std::move(*builder), name);
+    }
+
+    auto Module::load(const char *filename) -> Result<std::shared_ptr<const Module>> {
+        auto source = Source::map(filename);
+        if (!source)
+            return Error { .message = std::string("failed to open ") + filename + ": " + strerror(errno) };
+
+        std::string_view name = filename;
+        if (name.size() > 4 && name.substr(name.size() - 4) == ".glc"){
+            // the code runs straight out of the mapping, nothing is copied
+            auto mapped = map_bytecode(*source);
+            if (!mapped)
+                return Error { .message = std::string(filename) + " is not a module this version of glass can run" };
+            return from(std::move(mapped->builder), std::move(mapped->program), filename);
+        }
+        auto builder = glass::compile(*source, filename);
+        if (!builder)
+            return builder.error();
+        return from(std::move(*builder), filename);
+    }
+
+    std::optional<uint32_t> Module::find(std::string_view function) const {
+        uint32_t name = names.find(function);
+        if (name >= symbols.size() || symbols[name] < 0)
+            return {};
+        return symbols[name];
+    }
+
+    Context::Context(std::shared_ptr<const Module> module) : mod(std::move(module)) {
+        load();
+    }
+
+    Context::Context(std::shared_ptr<const Module> module, VMPool &pool) : mod(std::move(module)), machine(pool.acquire()) {
+        load();
+    }
+
+    void Context::load(){
+        machine.program = mod->program;
+    }
+
+    Result<uintptr_t> Context::call(std::string_view function){
+        auto entry = mod->find(function);
+        if (!entry)
+            return Error { .message = mod->name() + ": no function named " + std::string(function) };
+        return call(*entry);
+    }
+
+    Result<uintptr_t> Context::call(uint32_t entry){
+        if (entry >= mod->program->size)
+            return Error { .message = mod->name() + ": " + std::to_string(entry) + " is not in the module" };
+        if (machine.trap != Trap::None)
+            machine.reset(); // a stopped call is abandoned
+        return finish(machine.call(entry));
+    }
+
+    Result<uintptr_t> Context::resume(){
+        if (machine.trap != Trap::OutOfFuel && machine.trap != Trap::Deadline)
+            return Error { .message = mod->name() + ": nothing to resume" };
+        return finish(machine.resume());
+    }
+
+    Result<uintptr_t> Context::finish(bool ok){
+        if (!ok)
+            return Error { .message = mod->name() + ": " + trap_message(machine.trap), .trap = machine.trap };
+        return machine.registers[0];
+    }
+
+    Result<std::optional<uintptr_t>> Session::feed(std::string_view line){
+        std::string text(line);
+        TokenType first = Lexer(line).lookahead().type;
+        if (first == TokenType::Identifier || first == TokenType::IntLiteral || first == TokenType::Minus)
+            text = "return " + text + ";";
+
+        Source source(text);
+        Parser parser(Lexer{source});
+        while (parser.next_node()) {}
+        if (parser.failure)
+            return located(source, "<repl>", *parser.failure);
+        Ast &ast = parser.ast;
+        // top-level code goes first, where optimize() can't move its start
+        auto functions = std::stable_partition(ast.roots.begin(), ast.roots.end(), [&](NodeId id){
+            return ast[id].kind != NodeKind::FuncDecl;
+        });
+        bool toplevel = functions != ast.roots.begin();
+
+        IRBuilder::Mark mark = program.mark();
+        program.feed(ast);
+        if (!program.finalize()){
+            Error error = located(source, "<repl>", program.errors.front());
+            program.rewind(mark);
+            return error;
+        }
+        program.optimize(mark.ir);
+        // the builder owns the code, there's only this one VM to share it with
+        machine.program = Program::view(program.ir.data(), program.ir.size(), program.constants.data(),
+                                        program.constants.size(), nullptr);
+
+        int main = program.entry("main");
+        if (main >= (int)mark.ir)
+            machine.pc = main;
+        else if (toplevel)
+            machine.pc = mark.ir;
+        else
+            return std::optional<uintptr_t>();
+        if (!machine.run())
+            return Error { .message = trap_message(machine.trap), .trap = machine.trap };
+        return std::optional<uintptr_t>(machine.registers[0]);
+    }
+}
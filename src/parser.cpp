@@ -3,28 +3,30 @@
 namespace glass {
     bool Parser::next_node() {
         Token tok = lex.lookahead();
-        if (tok == TokenType::EndOfFile) return false;
+        if (failure || tok == TokenType::EndOfFile) return false;
         if (tok == TokenType::FuncKeyword){
             lex.next();
-            auto decl = std::make_shared<FuncDeclNode>();
-            decl->name = expect(TokenType::Identifier, "identifier");
+            NodeId decl = ast.add(ASTNode { .kind = NodeKind::FuncDecl });
+            ast[decl].token = expect(TokenType::Identifier, "identifier");
             expect(TokenType::OpenParentheses, "open parentheses to start parameter list");
-            while (!test(TokenType::CloseParentheses)){
-                break;
-            }
-            lex.next();
-            decl->block = parse_block_expr();
-            decl->block->parent = decl;
+            expect(TokenType::CloseParentheses, "close parentheses, functions don't take parameters yet");
+            NodeId block = parse_block_expr();
+            ast[decl].lhs = block;
+            ast[block].parent = decl;
             push(decl);
         } else if (tok == TokenType::ReturnKeyword){
             lex.next();
-            auto ret_stmt = std::make_shared<RetStmt>();
-            ret_stmt->expr = parse_expr();
-            ret_stmt->expr->parent = ret_stmt;
+            NodeId ret_stmt = ast.add(ASTNode { .kind = NodeKind::Ret });
+            NodeId expr = parse_expr();
+            ast[ret_stmt].lhs = expr;
+            ast[expr].parent = ret_stmt;
             expect(TokenType::Semicolon, "semicolon");
             push(ret_stmt);
+        } else {
+            error("expected func or return, got type {}", (int)tok.type);
+            return false;
         }
-        return true;
+        return !failure;
     }
 
     struct Precedence {
@@ -39,44 +41,43 @@ namespace glass {
         {20, 20},
     };
 
-    std::shared_ptr<ExprNode> Parser::parse_expr(int min_lbp){
-        std::shared_ptr<ExprNode> expr;
+    NodeId Parser::parse_expr(int min_lbp){
+        NodeId expr = NoNode;
         if (test(TokenType::IntLiteral)){
-            expr = std::make_shared<LiteralExpr>(lex.next());
+            expr = ast.add(ASTNode { .kind = NodeKind::Literal, .token = lex.next() });
         } else if (test(TokenType::Identifier)){
-            expr = std::make_shared<IdentExpr>(lex.next());
+            expr = ast.add(ASTNode { .kind = NodeKind::Ident, .token = lex.next() });
         } else if (test(TokenType::Minus)){
-            auto unary = std::make_shared<UnaryExpr>();
-            unary->op = lex.next();
-            unary->expr = parse_expr(100);
-            unary->expr->parent = unary;
+            NodeId unary = ast.add(ASTNode { .kind = NodeKind::Unary, .token = lex.next() });
+            NodeId operand = parse_expr(100);
+            ast[unary].lhs = operand;
+            ast[operand].parent = unary;
             expr = unary;
         } else if (test(TokenType::OpenCurly)){
             expr = parse_block_expr();
         } else {
             error("unexpected token");
+            // a stand-in so callers can carry on until they notice the failure
+            return ast.add(ASTNode { .kind = NodeKind::Literal });
         }
         while (1){
             Token tok = lex.lookahead();
             if (tok == TokenType::OpenParentheses){
                 lex.next();
-                lex.next();
-                auto call = std::make_shared<FuncCallExpr>();
-                call->func = expr;
-                expr->parent = call;
-                call->parameters = {};
+                expect(TokenType::CloseParentheses, "close parentheses, calls don't take arguments yet");
+                NodeId call = ast.add(ASTNode { .kind = NodeKind::FuncCall, .lhs = expr });
+                ast[expr].parent = call;
                 expr = call;
                 continue;
             }
             int index = (int)tok.type - (int)TokenType::Equal;
             if (index >= sizeof(precedence_tbl)/sizeof(Precedence) || index < 0) break;
             if (precedence_tbl[index].lbp <= min_lbp) break;
-            auto bin = std::make_shared<BinaryExpr>();
-            bin->op = lex.next();
-            bin->lhs = expr;
-            bin->lhs->parent = bin;
-            bin->rhs = parse_expr(precedence_tbl[index].rbp);
-            bin->rhs->parent = bin;
+            NodeId bin = ast.add(ASTNode { .kind = NodeKind::Binary, .token = lex.next(), .lhs = expr });
+            ast[expr].parent = bin;
+            NodeId rhs = parse_expr(precedence_tbl[index].rbp);
+            ast[bin].rhs = rhs;
+            ast[rhs].parent = bin;
             expr = bin;
         }
 
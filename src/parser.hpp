@@ -2,81 +2,87 @@
 #define __PARSER_HPP__
 #include <vector>
 #include <sstream>
-#include <variant>
+#include <cstring>
+#include <utility>
 #include <iostream>
 #include <stdint.h>
 #include "lexer.hpp"
 
 namespace glass {
-    struct ASTNode {
-        virtual ~ASTNode() = default;
-        std::shared_ptr<ASTNode> parent = nullptr;
-    };
-
-    struct ExprNode : ASTNode {
-        virtual ~ExprNode() = default; 
-    };
-
-    struct IdentExpr : ExprNode {
-        ~IdentExpr() override = default;
-
-        explicit IdentExpr(Token tok) : ident(tok){}
-        Token ident;
+    enum class NodeKind : unsigned char {
+        Ident, Literal, Block, FuncDecl, FuncCall, Binary, Unary, Ret
     };
 
-    struct BlockExpr : ExprNode {
-        ~BlockExpr() override = default;
-        std::vector<std::shared_ptr<ASTNode>> nodes = {};
-    };
-
-    struct DeclNode : ASTNode {
-        virtual ~DeclNode() = default;
-
-        size_t pos;
-        Token name;
-        Token type;
-    };
-
-    struct FuncDeclNode : DeclNode {
-        ~FuncDeclNode() override = default;
-        std::shared_ptr<BlockExpr> block = nullptr;
+    // nodes refer to each other by index into their Ast
+    using NodeId = uint32_t;
+    constexpr NodeId NoNode = UINT32_MAX;
+
+    // every node has the same shape, what the fields mean depends on kind:
+    //   Ident, Literal  token
+    //   Block           first/count = statements in Ast::lists
+    //   FuncDecl        token = name, lhs = body block
+    //   FuncCall        lhs = callee, first/count = parameters in Ast::lists
+    //   Binary          token = operator, lhs and rhs
+    //   Unary           token = operator, lhs = operand
+    //   Ret             lhs = returned expression
+    struct ASTNode {
+        NodeKind kind;
+        NodeId parent = NoNode;
+        Token token = {};
+        NodeId lhs = NoNode, rhs = NoNode;
+        uint32_t first = 0, count = 0;
     };
 
-    struct FuncCallExpr : ExprNode {
-        ~FuncCallExpr() override = default;
+    struct NodeList {
+        const NodeId *first, *last;
 
-        std::vector<std::shared_ptr<ExprNode>> parameters = {};
-        std::shared_ptr<ExprNode> func;
+        const NodeId *begin() const { return first; }
+        const NodeId *end() const { return last; }
+        size_t size() const { return last - first; }
     };
 
-    struct LiteralExpr : ExprNode {
-        ~LiteralExpr() override = default;
-        explicit LiteralExpr(Token lit) : lit(std::move(lit)) {}
-        Token lit;
-    };
+    // owns every node of a compilation unit. nodes are trivially destructible
+    // and never freed one by one, so dropping a whole tree is a couple of frees.
+    class Ast {
+    public:
+        std::vector<ASTNode> nodes = {};
+        std::vector<NodeId> lists = {};
+        std::vector<NodeId> roots = {};
 
-    struct BinaryExpr : ExprNode {
-        ~BinaryExpr() override = default;
-        std::shared_ptr<ExprNode> lhs, rhs;
-        Token op;
-    };
+        NodeId add(const ASTNode &node){
+            nodes.push_back(node);
+            return nodes.size() - 1;
+        }
 
-    struct UnaryExpr : ExprNode {
-        ~UnaryExpr() override = default;
-        Token op;
-        std::shared_ptr<ExprNode> expr;
-    };
+        ASTNode &operator[](NodeId id){
+            return nodes[id];
+        }
+        const ASTNode &operator[](NodeId id) const {
+            return nodes[id];
+        }
 
-    struct RetStmt : ASTNode {
-        ~RetStmt() override = default;
+        NodeList children(NodeId id) const {
+            const ASTNode &node = nodes[id];
+            return NodeList { lists.data() + node.first, lists.data() + node.first + node.count };
+        }
 
-        std::shared_ptr<ExprNode> expr;
+        void clear(){
+            nodes.clear();
+            lists.clear();
+            roots.clear();
+        }
     };
 
     class Parser {
     public:
-        explicit Parser(Lexer &&lex) : lex(std::move(lex)){}
-        std::vector<std::shared_ptr<ASTNode>> nodes = {};
+        explicit Parser(Lexer &&lex) : lex(std::move(lex)){
+            // typical code makes about one node per five bytes, growing the arena is the slow part otherwise
+            ast.nodes.reserve(this->lex.size() / 5);
+        }
+        Ast ast = {};
+        // the first syntax error. next_node() stops once there is one, and ast is
+        // only good for throwing away then
+        std::optional<Diagnostic> failure = {};
 
         bool test(TokenType type){
             return lex.lookahead() == type;
@@ -91,33 +97,44 @@ namespace glass {
 
         bool next_node();
 
-        std::shared_ptr<ExprNode> parse_expr(int min_lbp = 0);
-        std::shared_ptr<BlockExpr> parse_block_expr(){
+        NodeId parse_expr(int min_lbp = 0);
+        NodeId parse_block_expr(){
             expect(TokenType::OpenCurly, "open curly brace to start block");
-            auto block = std::make_shared<BlockExpr>();
-            scope = block;
-            while (!test(TokenType::CloseCurly)){
-                next_node();
+            NodeId block = ast.add(ASTNode { .kind = NodeKind::Block });
+            // statements collect on the scratch stack so each block's list ends up contiguous
+            NodeId outer = std::exchange(scope, block);
+            size_t start = scratch.size();
+            while (!failure && !test(TokenType::CloseCurly)){
+                if (test(TokenType::EndOfFile))
+                    error("expected close curly brace to end block");
+                else
+                    next_node();
             }
             lex.next();
-            scope = std::dynamic_pointer_cast<BlockExpr>(scope->parent);
+            scope = outer;
+            ast[block].first = ast.lists.size();
+            ast[block].count = scratch.size() - start;
+            ast.lists.insert(ast.lists.end(), scratch.begin() + start, scratch.end());
+            scratch.resize(start);
             return block;
         }
     private:
         Lexer lex;
-        std::shared_ptr<BlockExpr> scope = nullptr;
-        
-        void push(std::shared_ptr<ASTNode> node){
-            node->parent = scope;
-            if (!scope)
-                nodes.push_back(node);
+        NodeId scope = NoNode;
+        std::vector<NodeId> scratch = {};
+
+        void push(NodeId node){
+            ast[node].parent = scope;
+            if (scope == NoNode)
+                ast.roots.push_back(node);
             else
-                scope->nodes.push_back(node);
+                scratch.push_back(node);
         }
 
+        // errors point at the token that was unexpected
         template <typename ...Args>
         void error(const std::string &fmt, Args... args){
-            error(lex.get_pos(), fmt, std::forward<Args>(args)...);
+            error(lex.lookahead().pos, fmt, std::forward<Args>(args)...);
         }
 
         template <typename T>
@@ -137,9 +154,10 @@ namespace glass {
         }
 
         template <typename ...Args>
-        void error(SourceLocation loc, const std::string &fmt, Args... args){
+        void error(size_t pos, const std::string &fmt, Args... args){
+            if (failure)
+                return; // whatever follows the first error is usually just fallout
             std::ostringstream builder = {};
-            builder << loc.line << ":" << loc.col << ": ";
             
             const char *ptr = fmt.c_str();
             
@@ -148,8 +166,7 @@ namespace glass {
             else
                 builder << fmt;
 
-            std::cerr << builder.str() << std::endl;
-            exit(EXIT_FAILURE);
+            failure = Diagnostic { .pos = pos, .message = builder.str() };
         }
     };
 }
@@ -0,0 +1,259 @@
+#include "backend.hpp"
+
+namespace glass {
+    namespace {
+        enum Access { None = 0, Read = 1, Write = 2 };
+
+        // how ins touches register r
+        int access(const Instruction &ins, int r){
+            int dst = ins.dst == r, src = ins.src == r;
+            switch (ins.type){
+            case InstructionType::LoadImm:
+            case InstructionType::LoadConst:
+            case InstructionType::AddrStack:
+            case InstructionType::LoadStack:
+                return dst ? Write : None;
+            case InstructionType::Move:
+            case InstructionType::LoadByte:
+            case InstructionType::LoadHalf:
+            case InstructionType::LoadWord:
+            case InstructionType::LoadLong:
+            case InstructionType::LoadPtr:
+                return (src ? Read : None) | (dst ? Write : None);
+            case InstructionType::StrByte:
+            case InstructionType::StrHalf:
+            case InstructionType::StrWord:
+            case InstructionType::StrLong:
+            case InstructionType::StrPtr:
+                return dst || src ? Read : None;
+            case InstructionType::StrStack:
+                return dst ? Read : None;
+            case InstructionType::Add:
+            case InstructionType::Sub:
+            case InstructionType::Mul:
+            case InstructionType::Div:
+            case InstructionType::Shl:
+            case InstructionType::Shr:
+                return dst || src ? Read | (dst ? Write : None) : None;
+            case InstructionType::AddImm:
+            case InstructionType::SubImm:
+            case InstructionType::MulImm:
+            case InstructionType::DivImm:
+            case InstructionType::ShlImm:
+            case InstructionType::ShrImm:
+                return dst ? Read | Write : None;
+            default:
+                return None;
+            }
+        }
+
+        // true if nothing from pc on reads r before overwriting it. there are no
+        // branches, so the code after pc is the only path; callees don't take
+        // arguments in registers and clobber all of them, and only r0 is returned.
+        bool dead_from(const std::vector<Instruction> &ir, size_t pc, int r){
+            for (; pc < ir.size(); pc++){
+                const Instruction &ins = ir[pc];
+                switch (ins.type){
+                case InstructionType::Call:
+                case InstructionType::TailCall:
+                    return true;
+                case InstructionType::Return:
+                    return r != 0;
+                case InstructionType::LoadImmReturn:
+                    return r != 0 || ins.dst == 0;
+                case InstructionType::Halt:
+                    return false;
+                default:
+                    break;
+                }
+                int how = access(ins, r);
+                if (how & Read)
+                    return false;
+                if (how & Write)
+                    return true;
+            }
+            return false;
+        }
+
+        InstructionType with_imm(InstructionType type){
+            switch (type){
+            case InstructionType::Add: return InstructionType::AddImm;
+            case InstructionType::Sub: return InstructionType::SubImm;
+            case InstructionType::Mul: return InstructionType::MulImm;
+            case InstructionType::Div: return InstructionType::DivImm;
+            case InstructionType::Shl: return InstructionType::ShlImm;
+            case InstructionType::Shr: return InstructionType::ShrImm;
+            default: return type;
+            }
+        }
+
+        // the Return ending the function at body if it's worth copying into its
+        // callers, null otherwise: at most limit instructions before it, no calls,
+        // and nothing that touches the stack, since base is the caller's once it's
+        // copied. calls clobber every register but r0 anyway, so the copy can use
+        // them as it likes
+        const Instruction *inlinable(const Instruction *body, const Instruction *end, unsigned limit){
+            for (const Instruction *ins = body; ins < end && ins - body <= limit; ins++){
+                switch (ins->type){
+                case InstructionType::Return:
+                case InstructionType::LoadImmReturn:
+                    return ins;
+                case InstructionType::Push:
+                case InstructionType::Pop:
+                case InstructionType::AddrStack:
+                case InstructionType::LoadStack:
+                case InstructionType::StrStack:
+                case InstructionType::Halt:
+                case InstructionType::Call:
+                case InstructionType::TailCall:
+                case InstructionType::Compile:
+                case InstructionType::Symbol:
+                    return nullptr;
+                default:
+                    break;
+                }
+            }
+            return nullptr;
+        }
+
+        // the pairs below are the most frequent ones IRBuilder emits (see glass -p):
+        // constant operands, returning a constant, and spill stores and reloads.
+        // next is the index of b, so the rest of the function can be checked for liveness
+        bool fuse(const std::vector<Instruction> &ir, size_t next, Instruction &out){
+            const Instruction &a = ir[next - 1], &b = ir[next];
+            // Call f; Return => TailCall f
+            if (a.type == InstructionType::Call && b.type == InstructionType::Return){
+                out = Instruction { .type = InstructionType::TailCall, .dst = a.dst, .imm = a.imm };
+                return true;
+            }
+            if (a.type == InstructionType::LoadImm){
+                // LoadImm t, k; Add r, t => AddImm r, k
+                if (with_imm(b.type) != b.type && b.src == a.dst && b.dst != a.dst && dead_from(ir, next + 1, a.dst)){
+                    out = Instruction { .type = with_imm(b.type), .dst = b.dst, .imm = a.imm };
+                    return true;
+                }
+                // LoadImm r0, k; Return => LoadImmReturn r0, k
+                if (b.type == InstructionType::Return){
+                    out = Instruction { .type = InstructionType::LoadImmReturn, .dst = a.dst, .imm = a.imm };
+                    return true;
+                }
+            }
+            // AddrStack s, n; LoadLong r, s, 0 => LoadStack r, n
+            if (a.type == InstructionType::AddrStack && b.type == InstructionType::LoadLong && b.src == a.dst && b.imm == 0
+                && (b.dst == a.dst || dead_from(ir, next + 1, a.dst))){
+                out = Instruction { .type = InstructionType::LoadStack, .dst = b.dst, .imm = a.imm };
+                return true;
+            }
+            // AddrStack s, n; StrLong r, s, 0 => StrStack r, n
+            if (a.type == InstructionType::AddrStack && b.type == InstructionType::StrLong && b.src == a.dst && b.imm == 0
+                && b.dst != a.dst && dead_from(ir, next + 1, a.dst)){
+                out = Instruction { .type = InstructionType::StrStack, .dst = b.dst, .imm = a.imm };
+                return true;
+            }
+            return false;
+        }
+    }
+
+    // copies the body of every small function called from ir[from..] over its Call.
+    // a caller after its callee copies the already inlined version, so small
+    // functions calling small functions end up as one straight run
+    void IRBuilder::inline_calls(size_t from){
+        std::vector<Instruction> out = {};
+        out.reserve(ir.size() - from);
+        std::vector<uint32_t> moved(ir.size() - from + 1);
+        std::vector<Instruction> body = {};
+        bool changed = false;
+        for (size_t pc = from; pc < ir.size(); pc++){
+            moved[pc - from] = from + out.size();
+            const Instruction &ins = ir[pc];
+            const Instruction *start = nullptr, *end = nullptr;
+            if (ins.type == InstructionType::Call && ins.dst == 255 && ins.imm < ir.size()){
+                if (ins.imm >= from && ins.imm < pc){
+                    start = out.data() + (moved[ins.imm - from] - from);
+                    end = out.data() + out.size();
+                } else {
+                    start = ir.data() + ins.imm;
+                    end = ir.data() + ir.size();
+                }
+            }
+            const Instruction *ret = start ? inlinable(start, end, inline_limit) : nullptr;
+            if (!ret){
+                out.push_back(ins);
+                continue;
+            }
+            body.assign(start, ret);
+            if (ret->type == InstructionType::LoadImmReturn)
+                body.push_back(Instruction { .type = InstructionType::LoadImm, .dst = ret->dst, .imm = ret->imm });
+            out.insert(out.end(), body.begin(), body.end());
+            changed = true;
+        }
+        if (!changed)
+            return;
+        moved[ir.size() - from] = from + out.size();
+
+        for (Instruction &ins : out)
+            if (ins.type == InstructionType::Call && ins.imm >= from && ins.imm - from < moved.size())
+                ins.imm = moved[ins.imm - from];
+        for (Pending &pending : pending_list)
+            if (pending.pos >= from)
+                pending.pos = moved[pending.pos - from];
+        ir.resize(from);
+        ir.insert(ir.end(), out.begin(), out.end());
+    }
+
+    void IRBuilder::optimize(size_t from){
+        if (inline_limit)
+            inline_calls(from);
+
+        // nothing may be fused into an instruction that control lands on. code before
+        // from was finished earlier, so it can't call anything after it. the Return
+        // after a Call is one, unless the pair becomes a TailCall
+        std::vector<bool> target(ir.size() - from + 1, false);
+        for (size_t pc = from; pc < ir.size(); pc++){
+            if (ir[pc].type == InstructionType::Symbol)
+                target[pc + 1 - from] = true;
+            if (ir[pc].type == InstructionType::Call){
+                if (pc + 1 >= ir.size() || ir[pc + 1].type != InstructionType::Return)
+                    target[pc + 1 - from] = true;
+                if (ir[pc].imm >= from && ir[pc].imm <= ir.size())
+                    target[ir[pc].imm - from] = true;
+            }
+        }
+
+        std::vector<Instruction> out = {};
+        out.reserve(ir.size() - from);
+        std::vector<uint32_t> moved(ir.size() - from + 1);
+        while (!hints.empty() && hints.back().pc >= from)
+            hints.pop_back();
+        size_t first_hint = hints.size();
+        for (size_t pc = from; pc < ir.size(); pc++){
+            moved[pc - from] = from + out.size();
+            const Instruction &ins = ir[pc];
+            if (ins.type == InstructionType::Symbol){
+                hints.push_back(Hint { .pc = (uint32_t)(from + out.size()), .name = ins.imm });
+                continue;
+            }
+            Instruction fused;
+            if (pc + 1 < ir.size() && !target[pc + 1 - from] && fuse(ir, pc + 1, fused)){
+                moved[++pc - from] = from + out.size();
+                out.push_back(fused);
+                continue;
+            }
+            out.push_back(ins);
+        }
+        moved[ir.size() - from] = from + out.size();
+
+        for (Instruction &ins : out)
+            if ((ins.type == InstructionType::Call || ins.type == InstructionType::TailCall)
+                && ins.imm >= from && ins.imm - from < moved.size())
+                ins.imm = moved[ins.imm - from];
+        // every function defined here had a Symbol, the last definition of a name wins
+        for (size_t i = first_hint; i < hints.size(); i++)
+            symbols[hints[i].name] = hints[i].pc;
+        for (Pending &pending : pending_list)
+            if (pending.pos >= from)
+                pending.pos = moved[pending.pos - from];
+        ir.resize(from);
+        ir.insert(ir.end(), out.begin(), out.end());
+    }
+}
@@ -0,0 +1,187 @@
+#include "profile.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace glass {
+    uint64_t Profile::ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    Profile::Profile(const IRBuilder &builder, const Program &program){
+        std::vector<std::pair<uint32_t, std::string>> entries = builder.functions();
+        // code before the first function, the REPL runs expressions from there
+        if (entries.empty() || entries.front().first > 0)
+            entries.insert(entries.begin(), {0, "<toplevel>"});
+        for (const auto &[entry, name] : entries)
+            functions.push_back(Function { .name = name, .entry = entry });
+
+        types.resize(program.size);
+        counts.resize(program.size);
+        owner.resize(program.size);
+        size_t function = 0;
+        for (size_t pc = 0; pc < program.size; pc++){
+            while (function + 1 < functions.size() && functions[function + 1].entry <= pc)
+                function++;
+            types[pc] = program[pc].type;
+            owner[pc] = function;
+        }
+    }
+
+    void Profile::enter(uint32_t entry){
+        uint32_t function = entry < owner.size() ? owner[entry] : 0;
+        functions[function].calls++;
+        frames.push_back(Frame { .function = function, .start = ticks() });
+    }
+
+    void Profile::resume(uint32_t pc){
+        uint32_t function = pc < owner.size() ? owner[pc] : 0;
+        frames.push_back(Frame { .function = function, .start = ticks() });
+    }
+
+    void Profile::leave(){
+        if (frames.empty())
+            return;
+        Frame frame = frames.back();
+        frames.pop_back();
+        uint64_t total = ticks() - frame.start;
+        functions[frame.function].total += total;
+        functions[frame.function].self += total - std::min(total, frame.children);
+        if (!frames.empty())
+            frames.back().children += total;
+    }
+
+    auto Profile::totals() const -> std::vector<Function> {
+        std::vector<Function> result = functions;
+        for (size_t pc = 0; pc < counts.size(); pc++)
+            result[owner[pc]].instructions += counts[pc];
+        result.erase(std::remove_if(result.begin(), result.end(), [](const Function &fn){
+            return fn.calls == 0 && fn.instructions == 0;
+        }), result.end());
+        std::sort(result.begin(), result.end(), [](const Function &a, const Function &b){
+            return a.self != b.self ? a.self > b.self : a.instructions > b.instructions;
+        });
+        return result;
+    }
+
+    std::vector<uint64_t> Profile::opcode_counts() const {
+        std::vector<uint64_t> result(opcodes, 0);
+        for (size_t pc = 0; pc < counts.size(); pc++)
+            result[(size_t)types[pc]] += counts[pc];
+        return result;
+    }
+
+    namespace {
+        struct Pair {
+            size_t first, second;
+            uint64_t count;
+        };
+
+        template <size_t N>
+        std::vector<Pair> sorted_pairs(const uint64_t (&pairs)[N][N]){
+            std::vector<Pair> result = {};
+            for (size_t a = 0; a < N; a++)
+                for (size_t b = 0; b < N; b++)
+                    if (pairs[a][b])
+                        result.push_back(Pair { a, b, pairs[a][b] });
+            std::sort(result.begin(), result.end(), [](const Pair &x, const Pair &y){
+                return x.count > y.count;
+            });
+            return result;
+        }
+
+        double percent(uint64_t part, uint64_t whole){
+            return whole ? 100.0 * part / whole : 0.0;
+        }
+
+        std::string json_string(const std::string &str){
+            std::string out = "\"";
+            for (char c : str){
+                if (c == '"' || c == '\\')
+                    out += '\\';
+                if ((unsigned char)c < 0x20)
+                    continue;
+                out += c;
+            }
+            return out + "\"";
+        }
+    }
+
+    void Profile::report(std::ostream &out, const std::string &title) const {
+        std::vector<Function> fns = totals();
+        std::vector<uint64_t> ops = opcode_counts();
+        uint64_t instructions = 0, ticks_total = 0;
+        for (const Function &fn : fns){
+            instructions += fn.instructions;
+            ticks_total += fn.self;
+        }
+
+        out << "profile of " << title << ": " << instructions << " instructions, " << ticks_total << " ticks" << std::endl;
+        out << "  self%      self ticks     total ticks       calls    instructions  function" << std::endl;
+        for (const Function &fn : fns){
+            out << std::fixed << std::setprecision(1) << std::setw(7) << percent(fn.self, ticks_total)
+                << std::setw(16) << fn.self << std::setw(16) << fn.total << std::setw(12) << fn.calls
+                << std::setw(16) << fn.instructions << "  " << fn.name << std::endl;
+        }
+
+        std::vector<size_t> order(opcodes);
+        for (size_t i = 0; i < opcodes; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+            return ops[a] > ops[b];
+        });
+        out << "  opcode%           count  opcode" << std::endl;
+        for (size_t op : order){
+            if (!ops[op])
+                break;
+            out << std::setw(9) << percent(ops[op], instructions) << std::setw(16) << ops[op]
+                << "  " << instruction_name((InstructionType)op) << std::endl;
+        }
+
+        std::vector<Pair> top = sorted_pairs(pairs);
+        if (top.size() > 16)
+            top.resize(16);
+        out << "    pair%           count  pair" << std::endl;
+        for (const Pair &pair : top){
+            out << std::setw(9) << percent(pair.count, instructions) << std::setw(16) << pair.count << "  "
+                << instruction_name((InstructionType)pair.first) << " " << instruction_name((InstructionType)pair.second) << std::endl;
+        }
+        out << std::defaultfloat;
+    }
+
+    void Profile::write_json(std::ostream &out, const std::string &title) const {
+        std::vector<Function> fns = totals();
+        std::vector<uint64_t> ops = opcode_counts();
+
+        out << "{\"file\": " << json_string(title) << ", \"functions\": [";
+        for (size_t i = 0; i < fns.size(); i++){
+            const Function &fn = fns[i];
+            out << (i ? ", " : "") << "{\"name\": " << json_string(fn.name) << ", \"entry\": " << fn.entry
+                << ", \"calls\": " << fn.calls << ", \"instructions\": " << fn.instructions
+                << ", \"self_ticks\": " << fn.self << ", \"total_ticks\": " << fn.total << "}";
+        }
+        out << "], \"opcodes\": {";
+        bool first = true;
+        for (size_t op = 0; op < opcodes; op++){
+            if (!ops[op])
+                continue;
+            out << (first ? "" : ", ") << "\"" << instruction_name((InstructionType)op) << "\": " << ops[op];
+            first = false;
+        }
+        out << "}, \"pairs\": [";
+        std::vector<Pair> all = sorted_pairs(pairs);
+        for (size_t i = 0; i < all.size(); i++){
+            out << (i ? ", " : "") << "[\"" << instruction_name((InstructionType)all[i].first) << "\", \""
+                << instruction_name((InstructionType)all[i].second) << "\", " << all[i].count << "]";
+        }
+        out << "]}";
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef __PROFILE_HPP__
+#define __PROFILE_HPP__
+#include <ostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "backend.hpp"
+
+namespace glass {
+    // execution profile of one program. only filled in when glass is built with
+    // GLASS_PROFILE and a VM has one attached; the VM then counts every instruction
+    // it dispatches and times every function from Call to Return.
+    class Profile {
+    public:
+        struct Function {
+            std::string name;
+            uint32_t entry;
+            uint64_t calls = 0;
+            uint64_t instructions = 0;
+            uint64_t self = 0;  // ticks spent in the function itself
+            uint64_t total = 0; // ticks including callees
+        };
+
+        // functions come from builder.functions(), the code from program
+        Profile(const IRBuilder &builder, const Program &program);
+
+        void step(uint32_t pc, InstructionType type){
+            if (pc < counts.size())
+                counts[pc]++;
+            if (previous < opcodes)
+                pairs[previous][(size_t)type]++;
+            previous = (size_t)type;
+        }
+        void enter(uint32_t entry);
+        // back into the function pc is in after a stop, which isn't another call of it
+        void resume(uint32_t pc);
+        void leave();
+
+        // sorted by self time, then opcodes and opcode pairs by count
+        void report(std::ostream &out, const std::string &title) const;
+        void write_json(std::ostream &out, const std::string &title) const;
+
+        // rdtsc where there is one, nanoseconds elsewhere
+        static uint64_t ticks();
+
+    private:
+        static constexpr size_t opcodes = (size_t)InstructionType::Symbol + 1;
+
+        struct Frame {
+            uint32_t function;
+            uint64_t start;
+            uint64_t children = 0;
+        };
+
+        std::vector<InstructionType> types = {}; // opcode at each pc
+        std::vector<uint64_t> counts = {};       // executions of each pc
+        std::vector<uint32_t> owner = {};        // function each pc belongs to
+        std::vector<Function> functions = {};
+        std::vector<Frame> frames = {};
+        uint64_t pairs[opcodes][opcodes] = {};
+        size_t previous = opcodes; // nothing yet
+
+        std::vector<Function> totals() const;
+        std::vector<uint64_t> opcode_counts() const;
+    };
+}
+
+#endif//__PROFILE_HPP__
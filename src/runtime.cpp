@@ -0,0 +1,55 @@
+#include "runtime.hpp"
+#include "backend.hpp"
+#include "stack.hpp"
+#include <csignal>
+#include <cstdlib>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace {
+    glass_state state;
+    char *guard_begin = nullptr;
+    char signal_stack[65536];
+
+    // the same message and exit status glass gives for a program that overflows the VM.
+    // glass calls are native calls too, so running out of the native stack counts
+    void on_segv(int, siginfo_t *info, void *context){
+        char *addr = (char *)info->si_addr;
+        char *rsp = (char *)((ucontext_t *)context)->uc_mcontext.gregs[REG_RSP];
+        if ((addr >= guard_begin && addr < state.stack) || (addr < rsp && addr >= rsp - 65536)){
+            static const char message[] = "glass: stack overflow\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            _exit(EXIT_FAILURE);
+        }
+        // not ours: fault again without the handler
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+int main(){
+    // the stack the VM gets, with the guard below it
+    glass::StackLayout layout(glass::VM::stack_size);
+    void *mem = glass::map_stacks(layout, 1);
+    if (!mem){
+        static const char message[] = "glass: failed to map the stack\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        return EXIT_FAILURE;
+    }
+    state.stack = layout.stack(mem, 0);
+    state.sp = state.base = layout.size;
+    guard_begin = state.stack - layout.guard;
+
+    // the handler can't run on a native stack that just overflowed
+    stack_t alternate = {};
+    alternate.ss_sp = signal_stack;
+    alternate.ss_size = sizeof(signal_stack);
+    sigaltstack(&alternate, nullptr);
+    struct sigaction action = {};
+    action.sa_sigaction = on_segv;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, nullptr);
+
+    glass_main(&state);
+    return (int)state.registers[0];
+}
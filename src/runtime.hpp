@@ -0,0 +1,16 @@
+#ifndef __RUNTIME_HPP__
+#define __RUNTIME_HPP__
+#include <stdint.h>
+
+// what objects written by glassc expect to find in rdi, the glassrt runtime
+// sets it up and calls glass_main
+struct glass_state {
+    uintptr_t registers[256];
+    char *stack;
+    int sp;
+    int base;
+};
+
+extern "C" void glass_main(glass_state *state);
+
+#endif//__RUNTIME_HPP__
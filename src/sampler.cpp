@@ -0,0 +1,156 @@
+#include "sampler.hpp"
+#include "backend.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <map>
+#include <mutex>
+#include <sys/time.h>
+
+namespace glass {
+    Samples::Samples(size_t capacity){
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        stacks.resize(size);
+    }
+
+    void Samples::record(const VM &vm){
+        uint32_t pcs[max_depth];
+        size_t depth = 0;
+        bool truncated = false;
+        // the frame reset() leaves under everything, it only has the 0 sentinel
+        const int bottom = VM::stack_size - (int)sizeof(int);
+        const size_t size = vm.program->size;
+
+        pcs[depth++] = vm.pc;
+        // each frame is [return pc][caller's base] at base, call() adds [caller's pc] and
+        // uses 0 as the return pc. the signal can land halfway
+        // through a Call or Return, so anything that doesn't look like a frame ends the walk
+        for (int frame = vm.base; frame != bottom;){
+            if (frame < 0 || frame > VM::stack_size - 8)
+                break;
+            int ret = *(const int *)&vm.stack[frame];
+            int outer = *(const int *)&vm.stack[frame + 4];
+            if (outer <= frame || outer > bottom || (size_t)ret > size)
+                break;
+            if (ret == 0 && outer == bottom)
+                break; // call() from outside the VM
+            if (depth == max_depth){
+                truncated = true;
+                break;
+            }
+            if (ret){
+                pcs[depth++] = ret;
+            } else {
+                // entered through call() from native code, which saved the native
+                // function's pc. not what the frame below was called for, a TailCall
+                // may have replaced that since
+                uint32_t caller = unknown_native;
+                if (frame <= VM::stack_size - 12){
+                    int pc = *(const int *)&vm.stack[frame + 8];
+                    if (pc >= 0 && (size_t)pc < size)
+                        caller = pc | native;
+                }
+                pcs[depth++] = caller;
+            }
+            frame = outer;
+        }
+
+        uint64_t hash = 0xcbf29ce484222325 ^ truncated;
+        for (size_t i = 0; i < depth; i++){
+            hash ^= pcs[i];
+            hash *= 0x100000001b3;
+        }
+        hash += !hash;
+
+        size_t mask = stacks.size() - 1;
+        for (size_t probe = 0, i = hash & mask; probe < stacks.size(); probe++, i = (i + 1) & mask){
+            Stack &stack = stacks[i];
+            if (stack.hash == hash){
+                stack.count++;
+                return;
+            }
+            if (!stack.hash){
+                std::copy(pcs, pcs + depth, stack.pcs);
+                stack.depth = depth;
+                stack.truncated = truncated;
+                stack.count = 1;
+                stack.hash = hash;
+                return;
+            }
+        }
+        lost++;
+    }
+
+    uint64_t Samples::total() const {
+        uint64_t count = lost;
+        for (const Stack &stack : stacks)
+            count += stack.count;
+        return count;
+    }
+
+    void Samples::write_folded(std::ostream &out, const std::vector<std::pair<uint32_t, std::string>> &functions,
+                               const std::string &root) const {
+        auto name = [&](uint32_t pc) -> std::string {
+            if (pc == unknown_native)
+                return "[native]";
+            bool jitted = pc & native;
+            pc &= ~native;
+            auto it = std::upper_bound(functions.cbegin(), functions.cend(), pc, [](uint32_t pc, const auto &fn){
+                return pc < fn.first;
+            });
+            std::string result = it == functions.cbegin() ? "<toplevel>" : std::prev(it)->second;
+            return jitted ? result + "_[j]" : result; // the suffix flamegraph.pl colors as jit
+        };
+
+        // different pcs in the same functions fold into one line
+        std::map<std::string, uint64_t> folded = {};
+        for (const Stack &stack : stacks){
+            if (!stack.hash)
+                continue;
+            std::string line = root;
+            if (stack.truncated)
+                line += ";[truncated]";
+            for (size_t i = stack.depth; i-- > 0;)
+                line += ";" + name(stack.pcs[i]);
+            folded[line] += stack.count;
+        }
+        if (lost)
+            folded[root + ";[lost]"] += lost;
+        for (const auto &[line, count] : folded)
+            out << line << " " << count << "\n";
+    }
+
+    namespace {
+        void on_sigprof(int, siginfo_t *, void *){
+            int saved = errno;
+            const VM *vm = VM::current();
+            if (vm && vm->samples)
+                vm->samples->record(*vm);
+            errno = saved;
+        }
+    }
+
+    bool start_sampling(unsigned hz){
+        static std::once_flag once;
+        std::call_once(once, []{
+            struct sigaction action = {};
+            action.sa_sigaction = on_sigprof;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGPROF, &action, nullptr);
+        });
+        long usec = std::max(1000000l / std::max(hz, 1u), 1l);
+        struct itimerval timer = {};
+        timer.it_interval.tv_sec = usec / 1000000;
+        timer.it_interval.tv_usec = usec % 1000000;
+        timer.it_value = timer.it_interval;
+        return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+    }
+
+    void stop_sampling(){
+        struct itimerval timer = {};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+}
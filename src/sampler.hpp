@@ -0,0 +1,58 @@
+#ifndef __SAMPLER_HPP__
+#define __SAMPLER_HPP__
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace glass {
+    class VM;
+
+    // call stacks caught by the sampling profiler while one program ran. a SIGPROF
+    // timer (see start_sampling) interrupts whichever thread is using cpu, and if a
+    // VM with samples attached is running there its glass call stack is recorded:
+    // pc for the innermost function, then the return pc Call saved in each frame.
+    // identical stacks share an entry, so memory stays fixed however long it runs.
+    class Samples {
+    public:
+        static constexpr size_t max_depth = 64; // deeper stacks keep their innermost frames
+
+        explicit Samples(size_t capacity = 4096);
+
+        // called from the signal handler, so it doesn't allocate or lock
+        void record(const VM &vm);
+
+        // folded stacks for flamegraph.pl and friends, "root;outer;...;inner count" per
+        // line. functions are builder.functions() of the program that ran
+        void write_folded(std::ostream &out, const std::vector<std::pair<uint32_t, std::string>> &functions,
+                          const std::string &root) const;
+
+        uint64_t total() const;
+        uint64_t dropped() const {
+            return lost;
+        }
+
+    private:
+        // entries of pcs with this bit set are native functions, the rest is pcs[] as is
+        static constexpr uint32_t native = 0x80000000;
+        static constexpr uint32_t unknown_native = UINT32_MAX;
+
+        struct Stack {
+            uint64_t hash = 0; // 0 while the entry is free
+            uint64_t count = 0;
+            uint32_t depth = 0;
+            bool truncated = false;
+            uint32_t pcs[max_depth]; // innermost first
+        };
+        std::vector<Stack> stacks;
+        uint64_t lost = 0; // samples that found the table full
+    };
+
+    // SIGPROF every 1/hz seconds of cpu time used by the process. false if the timer
+    // couldn't be set up
+    bool start_sampling(unsigned hz);
+    void stop_sampling();
+}
+
+#endif//__SAMPLER_HPP__
@@ -0,0 +1,138 @@
+#include "backend.hpp"
+
+namespace glass {
+    namespace {
+        bool ends_function(InstructionType type){
+            return type == InstructionType::Return || type == InstructionType::LoadImmReturn
+                || type == InstructionType::TailCall || type == InstructionType::Halt;
+        }
+
+        bool calls(const Instruction &ins){
+            return ins.type == InstructionType::Call || ins.type == InstructionType::TailCall;
+        }
+    }
+
+    bool IRBuilder::shake(const std::vector<std::string> &entries){
+        // code splits into chunks at function entries. there are no branches, so a
+        // chunk runs from its entry to the first Return (or TailCall, ...), taking in
+        // any entry it passes on the way (a function defined inside another one), plus
+        // whatever dead code follows up to the next entry. chunks only move as a whole,
+        // so code that falls through into another function still does
+        std::vector<uint32_t> starts = {0};
+        for (const Hint &hint : hints)
+            starts.push_back(hint.pc);
+        for (const Instruction &ins : ir)
+            if (calls(ins))
+                starts.push_back(ins.imm);
+        std::sort(starts.begin(), starts.end());
+        starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+        while (!starts.empty() && starts.back() >= ir.size())
+            starts.pop_back();
+
+        std::vector<uint32_t> chunks = {}; // where each one starts, the next one's start is its end
+        for (size_t i = 0; i < starts.size();){
+            size_t pc = starts[i];
+            chunks.push_back(pc);
+            while (pc < ir.size() && !ends_function(ir[pc].type))
+                pc++;
+            while (i < starts.size() && starts[i] <= pc)
+                i++;
+        }
+        chunks.push_back(ir.size());
+        auto chunk_of = [&](uint32_t pc) -> uint32_t {
+            return std::upper_bound(chunks.cbegin(), chunks.cend(), pc) - chunks.cbegin() - 1;
+        };
+
+        std::vector<uint32_t> pending = {};
+        for (auto it = entries.crbegin(); it != entries.crend(); ++it){
+            int at = entry(*it);
+            if (at < 0 || (size_t)at >= ir.size())
+                return false;
+            pending.push_back(chunk_of(at));
+        }
+
+        // depth first from the entries, callees in order of how many times their caller
+        // calls them. with no branches that's exactly how often each runs per call of
+        // the caller, so the hottest callee ends up right behind it
+        std::vector<uint32_t> order = {};
+        std::vector<bool> placed(chunks.size() - 1, false);
+        std::vector<std::pair<uint32_t, uint32_t>> callees = {}; // chunk, calls
+        std::unordered_map<uint32_t, size_t> seen = {};
+        while (!pending.empty()){
+            uint32_t chunk = pending.back();
+            pending.pop_back();
+            if (placed[chunk])
+                continue;
+            placed[chunk] = true;
+            order.push_back(chunk);
+
+            callees.clear();
+            seen.clear();
+            for (uint32_t pc = chunks[chunk]; pc < chunks[chunk + 1]; pc++){
+                if (!calls(ir[pc]) || ir[pc].imm >= ir.size())
+                    continue;
+                uint32_t callee = chunk_of(ir[pc].imm);
+                auto [it, added] = seen.try_emplace(callee, callees.size());
+                if (added)
+                    callees.push_back({callee, 0});
+                callees[it->second].second++;
+            }
+            std::stable_sort(callees.begin(), callees.end(), [](const auto &a, const auto &b){
+                return a.second > b.second;
+            });
+            for (auto it = callees.crbegin(); it != callees.crend(); ++it)
+                if (!placed[it->first])
+                    pending.push_back(it->first);
+        }
+
+        std::vector<Instruction> out = {};
+        std::vector<int64_t> moved(chunks.size() - 1, 0); // how far each placed chunk moves
+        for (uint32_t chunk : order){
+            moved[chunk] = (int64_t)out.size() - chunks[chunk];
+            out.insert(out.end(), ir.begin() + chunks[chunk], ir.begin() + chunks[chunk + 1]);
+        }
+
+        std::vector<uintptr_t> kept_constants = {};
+        std::vector<int64_t> constant_at(constants.size(), -1);
+        for (Instruction &ins : out){
+            if (calls(ins) && ins.imm < ir.size())
+                ins.imm += moved[chunk_of(ins.imm)];
+            if (ins.type == InstructionType::LoadConst && ins.imm < constants.size()){
+                if (constant_at[ins.imm] < 0){
+                    constant_at[ins.imm] = kept_constants.size();
+                    kept_constants.push_back(constants[ins.imm]);
+                }
+                ins.imm = constant_at[ins.imm];
+            }
+        }
+
+        // names are only kept for the functions that are
+        auto kept = [&](int pc){
+            return pc >= 0 && (size_t)pc < ir.size() && placed[chunk_of(pc)];
+        };
+        Names kept_names = {};
+        std::vector<Hint> kept_hints = {};
+        for (const Hint &hint : hints){
+            if (!kept(hint.pc))
+                continue;
+            kept_hints.push_back(Hint { .pc = (uint32_t)(hint.pc + moved[chunk_of(hint.pc)]), .name = kept_names.intern(names[hint.name]) });
+        }
+        std::sort(kept_hints.begin(), kept_hints.end(), [](const Hint &a, const Hint &b){
+            return a.pc < b.pc;
+        });
+        std::vector<std::pair<uint32_t, int>> kept_entries = {};
+        for (uint32_t name = 0; name < symbols.size(); name++)
+            if (kept(symbols[name]))
+                kept_entries.push_back({kept_names.intern(names[name]), symbols[name] + moved[chunk_of(symbols[name])]});
+        symbols.assign(kept_names.size(), -1);
+        for (const auto &[name, entry] : kept_entries)
+            symbols[name] = entry;
+
+        ir = std::move(out);
+        constants = std::move(kept_constants);
+        hints = std::move(kept_hints);
+        names = std::move(kept_names);
+        shadowed.clear();
+        return true;
+    }
+}
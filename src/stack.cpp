@@ -0,0 +1,201 @@
+#include "backend.hpp"
+#include "stack.hpp"
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <csetjmp>
+#include <csignal>
+#include <sys/mman.h>
+
+namespace glass {
+    namespace {
+        const StackLayout &stack_layout(){
+            static const StackLayout layout(VM::stack_size);
+            return layout;
+        }
+
+        void *map_or_throw(const StackLayout &layout, size_t count){
+            void *mem = map_stacks(layout, count);
+            if (!mem)
+                throw std::bad_alloc();
+            return mem;
+        }
+
+        // the innermost guarded run on this thread, faults in its guard jump back to it
+        struct GuardFrame {
+            const VM *vm;
+            char *guard_begin;
+            sigjmp_buf env;
+        };
+        thread_local GuardFrame *active_guard = nullptr;
+        struct sigaction previous_segv = {};
+
+        void on_segv(int sig, siginfo_t *info, void *context){
+            char *addr = (char *)info->si_addr;
+            GuardFrame *frame = active_guard;
+            if (frame && addr >= frame->guard_begin && addr < frame->vm->stack)
+                siglongjmp(frame->env, (int)glass::Trap::StackOverflow);
+            // not ours: hand it to whoever had SIGSEGV before, and stay installed for
+            // the next one in case they recover from it
+            if (previous_segv.sa_flags & SA_SIGINFO){
+                previous_segv.sa_sigaction(sig, info, context);
+                return;
+            }
+            if (previous_segv.sa_handler != SIG_DFL && previous_segv.sa_handler != SIG_IGN){
+                previous_segv.sa_handler(sig);
+                return;
+            }
+            // a raise() or kill() that was being ignored stays ignored. a real fault can't
+            // be, so like everything else that ends up with the default it kills the process
+            if (previous_segv.sa_handler == SIG_IGN && info->si_code <= 0)
+                return;
+            signal(SIGSEGV, SIG_DFL);
+            raise(SIGSEGV);
+        }
+
+        void install_segv_handler(){
+            static std::once_flag once;
+            std::call_once(once, []{
+                struct sigaction action = {};
+                action.sa_sigaction = on_segv;
+                // NODEFER since we leave through siglongjmp without restoring the mask
+                action.sa_flags = SA_SIGINFO | SA_NODEFER;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGSEGV, &action, &previous_segv);
+            });
+        }
+    }
+
+    template <typename Body>
+    bool VM::guarded(Body &&body){
+        // nested entries (native code calling back into the VM) are covered by the outer one
+        if (active_guard && active_guard->vm == this){
+            body();
+            return trap == Trap::None;
+        }
+        GuardFrame frame;
+        frame.vm = this;
+        frame.guard_begin = stack - stack_layout().guard;
+        GuardFrame *outer = active_guard;
+        if (int caught = sigsetjmp(frame.env, 0)){
+            active_guard = outer;
+            reset();
+            trap = (Trap)caught;
+            return false;
+        }
+        trap = Trap::None;
+        active_guard = &frame;
+        body();
+        active_guard = outer;
+        return trap == Trap::None;
+    }
+
+    bool VM::run(){
+        return guarded([&]{ execute(); });
+    }
+
+    bool VM::call(int target){
+        return guarded([&]{ enter(target); });
+    }
+
+    bool VM::resume(){
+        return guarded([&]{
+            resuming = true;
+            execute();
+            if (trap == Trap::None && stopped_call >= 0){
+                int caller = stopped_call;
+                stopped_call = -1;
+                leave(caller);
+            }
+        });
+    }
+
+    void VM::unwind(Trap why){
+        siglongjmp(active_guard->env, (int)why);
+    }
+
+    const VM *VM::current(){
+        const GuardFrame *frame = active_guard;
+        return frame ? frame->vm : nullptr;
+    }
+
+    VM::VM(){
+        install_segv_handler();
+        const StackLayout &layout = stack_layout();
+        stack = layout.stack(map_or_throw(layout, 1), 0);
+        reset();
+    }
+
+    VM::VM(VMPool *pool, char *stack) : stack(stack), pool(pool) {
+        reset();
+    }
+
+    VM::VM(VM &&other) noexcept : stack(nullptr) {
+        *this = std::move(other);
+    }
+
+    VM &VM::operator=(VM &&other) noexcept {
+        if (this == &other)
+            return *this;
+        release_stack();
+        program = std::move(other.program);
+        pc = other.pc;
+        stack = other.stack;
+        sp = other.sp;
+        base = other.base;
+        memcpy(registers, other.registers, sizeof(registers));
+        jit = other.jit;
+        trap = other.trap;
+        native_depth = other.native_depth;
+        fuel = other.fuel;
+        deadline = other.deadline;
+        stopped_call = other.stopped_call;
+        resuming = other.resuming;
+        tail_call = other.tail_call;
+        samples = other.samples;
+        lazy = other.lazy;
+#ifdef GLASS_PROFILE
+        profile = other.profile;
+#endif
+        pool = other.pool;
+        other.stack = nullptr;
+        other.pool = nullptr;
+        return *this;
+    }
+
+    VM::~VM(){
+        release_stack();
+    }
+
+    void VM::release_stack(){
+        if (!stack)
+            return;
+        if (pool){
+            pool->recycle(stack);
+        } else {
+            const StackLayout &layout = stack_layout();
+            munmap(layout.mapping(stack), layout.stride());
+        }
+        stack = nullptr;
+    }
+
+    VM VMPool::acquire(){
+        if (free_stacks.empty()){
+            install_segv_handler();
+            const StackLayout &layout = stack_layout();
+            void *mem = map_or_throw(layout, stacks_per_slab);
+            slabs.push_back(Slab { .mem = mem, .length = layout.stride() * stacks_per_slab });
+            // handed out from the front of the slab first
+            for (size_t i = stacks_per_slab; i-- > 0;)
+                free_stacks.push_back(layout.stack(mem, i));
+        }
+        char *stack = free_stacks.back();
+        free_stacks.pop_back();
+        return VM(this, stack);
+    }
+
+    VMPool::~VMPool(){
+        for (const Slab &slab : slabs)
+            munmap(slab.mem, slab.length);
+    }
+}
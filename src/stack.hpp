@@ -0,0 +1,47 @@
+#ifndef __STACK_HPP__
+#define __STACK_HPP__
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the guarded stacks glass code runs on, shared by the VM and the glassrt runtime
+namespace glass {
+    // at least this much guard sits below every stack
+    constexpr size_t stack_guard = 65536;
+
+    // every stack is a page-aligned region with a guard below it. the guard is
+    // bigger than a page so a single large Push can't step over it
+    struct StackLayout {
+        size_t size, guard, region;
+
+        explicit StackLayout(size_t size) : size(size) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            guard = (stack_guard + page - 1) & ~(page - 1);
+            region = (size + page - 1) & ~(page - 1);
+        }
+
+        size_t stride() const {
+            return guard + region;
+        }
+        // the stack is at the top of its region, sp starts at the region's end
+        char *stack(void *mem, size_t i) const {
+            return (char *)mem + i * stride() + guard + region - size;
+        }
+        void *mapping(char *stack) const {
+            return stack - (guard + region - size);
+        }
+    };
+
+    // the kernel only backs the pages a program actually touches. null if it
+    // can't be mapped at all
+    inline void *map_stacks(const StackLayout &layout, size_t count){
+        void *mem = mmap(nullptr, layout.stride() * count, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED)
+            return nullptr;
+        for (size_t i = 0; i < count; i++)
+            mprotect((char *)mem + i * layout.stride() + layout.guard, layout.region, PROT_READ | PROT_WRITE);
+        return mem;
+    }
+}
+
+#endif//__STACK_HPP__
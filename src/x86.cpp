@@ -0,0 +1,209 @@
+#include "x86.hpp"
+#include "backend.hpp"
+
+namespace glass {
+    bool X86Assembler::lower(const Instruction &ins, const uintptr_t *constants){
+        switch (ins.type){
+        case InstructionType::Symbol:
+            return true;
+
+        case InstructionType::Push:
+            rbx_mem({0x81}, 5, layout.sp); // sub dword [rbx + sp], imm32
+            imm32(ins.imm);
+            return true;
+        case InstructionType::Pop:
+            rbx_mem({0x81}, 0, layout.sp); // add dword [rbx + sp], imm32
+            imm32(ins.imm);
+            return true;
+        case InstructionType::AddrStack:
+            addr_stack(ins.imm);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::LoadStack:
+            addr_stack(ins.imm);
+            bytes({0x48, 0x8B, 0x00}); // mov rax, [rax]
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::StrStack:
+            addr_stack(ins.imm);
+            load_rcx(ins.dst);
+            bytes({0x48, 0x89, 0x08}); // mov [rax], rcx
+            return true;
+
+        case InstructionType::LoadImm:
+            byte(0xB8); // mov eax, imm32
+            imm32(ins.imm);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::LoadConst:
+            bytes({0x48, 0xB8}); // mov rax, imm64
+            imm64(constants[ins.imm]);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::Move:
+            load_rax(ins.src);
+            store_rax(ins.dst);
+            return true;
+
+        // [rax + disp32] has modrm 0x80, with rcx as the register operand 0x88
+        case InstructionType::LoadByte:
+            load_rax(ins.src);
+            bytes({0x48, 0x0F, 0xBE, 0x80}); // movsx rax, byte [rax + disp32]
+            imm32(ins.imm);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::LoadHalf:
+            load_rax(ins.src);
+            bytes({0x0F, 0xB7, 0x80}); // movzx eax, word [rax + disp32]
+            imm32(ins.imm);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::LoadWord:
+            load_rax(ins.src);
+            bytes({0x8B, 0x80}); // mov eax, [rax + disp32]
+            imm32(ins.imm);
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::LoadLong:
+        case InstructionType::LoadPtr:
+            load_rax(ins.src);
+            bytes({0x48, 0x8B, 0x80}); // mov rax, [rax + disp32]
+            imm32(ins.imm);
+            store_rax(ins.dst);
+            return true;
+
+        case InstructionType::StrByte:
+            load_rax(ins.src);
+            load_rcx(ins.dst);
+            bytes({0x88, 0x88}); // mov [rax + disp32], cl
+            imm32(ins.imm);
+            return true;
+        case InstructionType::StrHalf:
+            load_rax(ins.src);
+            load_rcx(ins.dst);
+            bytes({0x66, 0x89, 0x88}); // mov [rax + disp32], cx
+            imm32(ins.imm);
+            return true;
+        case InstructionType::StrWord:
+            load_rax(ins.src);
+            load_rcx(ins.dst);
+            bytes({0x89, 0x88}); // mov [rax + disp32], ecx
+            imm32(ins.imm);
+            return true;
+        case InstructionType::StrLong:
+        case InstructionType::StrPtr:
+            load_rax(ins.src);
+            load_rcx(ins.dst);
+            bytes({0x48, 0x89, 0x88}); // mov [rax + disp32], rcx
+            imm32(ins.imm);
+            return true;
+
+        case InstructionType::Add:
+            load_rax(ins.dst);
+            rbx_mem({0x48, 0x03}, 0, reg(ins.src)); // add rax, [src]
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::Sub:
+            load_rax(ins.dst);
+            rbx_mem({0x48, 0x2B}, 0, reg(ins.src)); // sub rax, [src]
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::Mul:
+            load_rax(ins.dst);
+            rbx_mem({0x48, 0x0F, 0xAF}, 0, reg(ins.src)); // imul rax, [src]
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::Div:
+            load_rax(ins.dst);
+            bytes({0x31, 0xD2});                    // xor edx, edx
+            rbx_mem({0x48, 0xF7}, 6, reg(ins.src)); // div qword [src]
+            store_rax(ins.dst);
+            return true;
+
+        case InstructionType::Shl:
+            load_rax(ins.dst);
+            load_rcx(ins.src);
+            bytes({0x48, 0xD3, 0xE0}); // shl rax, cl
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::Shr:
+            load_rax(ins.dst);
+            load_rcx(ins.src);
+            bytes({0x48, 0xD3, 0xE8}); // shr rax, cl
+            store_rax(ins.dst);
+            return true;
+
+        // the immediate goes through ecx so it stays zero-extended like LoadImm
+        case InstructionType::AddImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x48, 0x01, 0xC8}); // add rax, rcx
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::SubImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x48, 0x29, 0xC8}); // sub rax, rcx
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::MulImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x48, 0x0F, 0xAF, 0xC1}); // imul rax, rcx
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::DivImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x31, 0xD2});       // xor edx, edx
+            bytes({0x48, 0xF7, 0xF1}); // div rcx
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::ShlImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x48, 0xD3, 0xE0}); // shl rax, cl
+            store_rax(ins.dst);
+            return true;
+        case InstructionType::ShrImm:
+            load_rax(ins.dst);
+            imm_rcx(ins.imm);
+            bytes({0x48, 0xD3, 0xE8}); // shr rax, cl
+            store_rax(ins.dst);
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    void X86Assembler::call_abs(uintptr_t fn, uint32_t arg){
+        bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        byte(0xBE);                // mov esi, imm32
+        imm32(arg);
+        bytes({0x48, 0xB8});       // mov rax, imm64
+        imm64(fn);
+        bytes({0xFF, 0xD0});       // call rax
+    }
+
+    size_t X86Assembler::call_rel(){
+        bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        byte(0xE8);                // call rel32
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    size_t X86Assembler::jump_rel(){
+        bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+        byte(0x5B);                // pop rbx
+        byte(0xE9);                // jmp rel32
+        imm32(0);
+        return code.size() - 4;
+    }
+
+    void X86Assembler::patch_rel(size_t at, size_t target){
+        uint32_t rel = (uint32_t)(target - (at + 4));
+        for (int i = 0; i < 4; i++)
+            code[at + i] = rel >> (i * 8);
+    }
+}
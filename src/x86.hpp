@@ -0,0 +1,110 @@
+#ifndef __X86_HPP__
+#define __X86_HPP__
+#include <vector>
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace glass {
+    struct Instruction;
+
+    // x86-64 lowering shared by the jit and glassc. generated functions take the
+    // VM state in rdi and keep it in rbx; the layout says where each field lives.
+    class X86Assembler {
+    public:
+        struct Layout {
+            int32_t regs, stack, sp, base;
+        };
+
+        std::vector<unsigned char> code = {};
+        Layout layout;
+
+        explicit X86Assembler(Layout layout) : layout(layout) {}
+
+        void prologue(){
+            bytes({0x53});             // push rbx
+            bytes({0x48, 0x89, 0xFB}); // mov rbx, rdi
+        }
+        void epilogue(){
+            bytes({0x5B, 0xC3}); // pop rbx; ret
+        }
+
+        // base = sp for the function's spill slots, for code that isn't called through the VM
+        void enter_frame(){
+            rbx_mem({0x8B}, 0, layout.base);   // mov eax, [rbx + base]
+            bytes({0x50});                     // push rax
+            bytes({0x48, 0x83, 0xEC, 0x08});   // sub rsp, 8 (keeps rsp aligned for calls)
+            rbx_mem({0x8B}, 0, layout.sp);     // mov eax, [rbx + sp]
+            rbx_mem({0x89}, 0, layout.base);   // mov [rbx + base], eax
+        }
+        void leave_frame(){
+            rbx_mem({0x8B}, 0, layout.base);   // mov eax, [rbx + base]
+            rbx_mem({0x89}, 0, layout.sp);     // mov [rbx + sp], eax
+            bytes({0x48, 0x83, 0xC4, 0x08});   // add rsp, 8
+            bytes({0x58});                     // pop rax
+            rbx_mem({0x89}, 0, layout.base);   // mov [rbx + base], eax
+        }
+
+        // lowers everything but control flow, false for instructions that need the caller
+        bool lower(const Instruction &ins, const uintptr_t *constants);
+
+        // mov dword [rbx + disp], value, for state fields the layout doesn't cover
+        void store_imm(int32_t disp, uint32_t value){
+            rbx_mem({0xC7}, 0, disp);
+            imm32(value);
+        }
+        // call fn(state, arg) through an absolute address
+        void call_abs(uintptr_t fn, uint32_t arg);
+        // call another generated function, returns the offset of the rel32 to patch
+        size_t call_rel();
+        // epilogue() that goes on to another generated function instead of returning,
+        // offset of the rel32 to patch
+        size_t jump_rel();
+        void patch_rel(size_t at, size_t target);
+
+    private:
+        void byte(unsigned char b){
+            code.push_back(b);
+        }
+        void bytes(std::initializer_list<unsigned char> bs){
+            code.insert(code.end(), bs);
+        }
+        void imm32(uint32_t v){
+            for (int i = 0; i < 4; i++)
+                byte(v >> (i * 8));
+        }
+        void imm64(uint64_t v){
+            for (int i = 0; i < 8; i++)
+                byte(v >> (i * 8));
+        }
+
+        int32_t reg(unsigned char r){
+            return layout.regs + r * 8;
+        }
+
+        // op r, [rbx + disp32]
+        void rbx_mem(std::initializer_list<unsigned char> op, unsigned char modrm_reg, int32_t disp){
+            bytes(op);
+            byte(0x80 | (modrm_reg << 3) | 3);
+            imm32(disp);
+        }
+        void load_rax(unsigned char r){ rbx_mem({0x48, 0x8B}, 0, reg(r)); }
+        void load_rcx(unsigned char r){ rbx_mem({0x48, 0x8B}, 1, reg(r)); }
+        void store_rax(unsigned char r){ rbx_mem({0x48, 0x89}, 0, reg(r)); }
+        void imm_rcx(uint32_t v){
+            byte(0xB9); // mov ecx, imm32
+            imm32(v);
+        }
+
+        // rax = stack + base - offset
+        void addr_stack(uint32_t offset){
+            rbx_mem({0x48, 0x8B}, 0, layout.stack); // mov rax, [rbx + stack]
+            rbx_mem({0x8B}, 1, layout.base);        // mov ecx, [rbx + base]
+            bytes({0x81, 0xE9});                    // sub ecx, imm32
+            imm32(offset);
+            bytes({0x48, 0x01, 0xC8});              // add rax, rcx
+        }
+    };
+}
+
+#endif//__X86_HPP__